@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Micro benchmarks for wsh. Build with `make bench` and run ./bench from the repo root.
+
+#define DEFAULT_ITERATIONS 2000
+
+typedef struct {
+    const char *name;
+    const char *builtin_cmd;    // runs in-process
+    const char *external_cmd;   // same work through fork + exec
+} BenchCase;
+
+static const BenchCase builtin_cases[] = {
+    { "echo", "echo hello", "/bin/echo hello" },
+    { "printf", "printf %s-%d\\n x 1", "/usr/bin/printf %s-%d\\n x 1" },
+    { "test", "test 1 -eq 1", "/usr/bin/test 1 -eq 1" },
+    { "true", "true", "/bin/true" },
+    { NULL, NULL, NULL },
+};
+
+// foreground pipelines whose builtin stages run on a thread, or in a fork with --fork-builtins
+static const char *pipeline_cases[] = {
+    "echo hello | true",
+    "printf %s-%d\\n x 1 | true",
+    "echo hello | /bin/cat",
+    NULL,
+};
+
+// walk over a system tree against find(1) doing the same listing
+static const BenchCase walk_cases[] = {
+    { "list", "walk /usr", "/usr/bin/find /usr" },
+    { "-name", "walk /usr -name *.h", "/usr/bin/find /usr -name *.h" },
+    { "sorted", "walk -s /usr", "/usr/bin/find /usr | /usr/bin/sort" },
+    { NULL, NULL, NULL },
+};
+
+#define WALK_RUNS 5
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// writes cmd to a batch file count times
+static int write_script(const char *path, const char *cmd, int count) {
+    FILE *script = fopen(path, "w");
+    if (script == NULL) {
+        perror("Failed to create bench script");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        fprintf(script, "%s\n", cmd);
+    }
+    fclose(script);
+    return 0;
+}
+
+// runs ./wsh [option] on a batch file with output discarded, returns wall seconds
+static double run_wsh(const char *script_path, const char *option) {
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        if (option != NULL) {
+            execl("./wsh", "./wsh", option, script_path, (char *)NULL);
+        } else {
+            execl("./wsh", "./wsh", script_path, (char *)NULL);
+        }
+        perror("exec ./wsh");
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return now_seconds() - start;
+}
+
+// seconds per line for cmd repeated count times, minus an empty run
+static double per_call(const char *cmd, int count, double baseline, const char *option) {
+    if (write_script("bench_script.wsh", cmd, count) != 0) {
+        return -1;
+    }
+    double elapsed = run_wsh("bench_script.wsh", option);
+    remove("bench_script.wsh");
+    return (elapsed - baseline) / count;
+}
+
+static void bench_builtins(int iterations, double baseline) {
+    printf("\nBuiltin vs external (%d calls each):\n", iterations);
+    printf("%-10s %14s %14s %10s\n", "command", "builtin us", "external us", "speedup");
+    for (const BenchCase *c = builtin_cases; c->name != NULL; c++) {
+        double in_process = per_call(c->builtin_cmd, iterations, baseline, NULL);
+        double forked = per_call(c->external_cmd, iterations, baseline, NULL);
+        printf("%-10s %14.2f %14.2f %9.1fx\n", c->name, in_process * 1e6, forked * 1e6,
+               in_process > 0 ? forked / in_process : 0);
+    }
+}
+
+static void bench_pipelines(int iterations, double baseline) {
+    printf("\nBuiltin stages on a thread vs forked (%d lines each):\n", iterations);
+    printf("%-28s %12s %12s %10s\n", "line", "thread us", "fork us", "speedup");
+    for (const char **cmd = pipeline_cases; *cmd != NULL; cmd++) {
+        double threaded = per_call(*cmd, iterations, baseline, NULL);
+        double forked = per_call(*cmd, iterations, baseline, "--fork-builtins");
+        printf("%-28s %12.2f %12.2f %9.1fx\n", *cmd, threaded * 1e6, forked * 1e6,
+               threaded > 0 ? forked / threaded : 0);
+    }
+}
+
+// the sample plugin's count loaded with enable -f, against the same code as a binary
+static void bench_plugin(int iterations, double baseline) {
+    if (access("./count.so", R_OK) != 0 || access("./count-ext", X_OK) != 0) {
+        printf("\nLoaded builtin: skipped, run make plugins first\n");
+        return;
+    }
+    FILE *input = fopen("bench_input.txt", "w");
+    FILE *script = fopen("bench_script.wsh", "w");
+    if (input == NULL || script == NULL) {
+        perror("Failed to create plugin bench files");
+        return;
+    }
+    for (int i = 0; i < 100; i++) {
+        fprintf(input, "line %d of the plugin benchmark input\n", i);
+    }
+    fclose(input);
+    fprintf(script, "enable -f ./count.so count\n");
+    for (int i = 0; i < iterations; i++) {
+        fprintf(script, "count bench_input.txt\n");
+    }
+    fclose(script);
+    double loaded = (run_wsh("bench_script.wsh", NULL) - baseline) / iterations;
+    remove("bench_script.wsh");
+    double external = per_call("./count-ext bench_input.txt", iterations, baseline, NULL);
+    remove("bench_input.txt");
+
+    printf("\nLoaded builtin vs external binary (%d calls each):\n", iterations);
+    printf("%-10s %14s %14s %10s\n", "command", "loaded us", "external us", "speedup");
+    printf("%-10s %14.2f %14.2f %9.1fx\n", "count", loaded * 1e6, external * 1e6, loaded > 0 ? external / loaded : 0);
+}
+
+// best of a few runs each, so both sides see a warm dentry cache
+static void bench_walk(double baseline) {
+    if (access("/usr/bin/find", X_OK) != 0) {
+        printf("\nwalk vs find: skipped, /usr/bin/find not found\n");
+        return;
+    }
+    printf("\nwalk vs find over /usr (best of %d runs):\n", WALK_RUNS);
+    printf("%-10s %14s %14s %10s\n", "case", "walk ms", "find ms", "speedup");
+    for (const BenchCase *c = walk_cases; c->name != NULL; c++) {
+        double walked = 0, found = 0;
+        for (int i = 0; i < WALK_RUNS; i++) {
+            double w = per_call(c->builtin_cmd, 1, baseline, NULL);
+            double f = per_call(c->external_cmd, 1, baseline, NULL);
+            walked = (i == 0 || w < walked) ? w : walked;
+            found = (i == 0 || f < found) ? f : found;
+        }
+        printf("%-10s %14.2f %14.2f %9.1fx\n", c->name, walked * 1e3, found * 1e3,
+               walked > 0 ? found / walked : 0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = DEFAULT_ITERATIONS;
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+        if (iterations <= 0) {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (access("./wsh", X_OK) != 0) {
+        fprintf(stderr, "bench: ./wsh not found, run make first\n");
+        return 1;
+    }
+
+    // startup and teardown cost of the shell itself
+    if (write_script("bench_script.wsh", "# empty", 1) != 0) {
+        return 1;
+    }
+    double baseline = run_wsh("bench_script.wsh", NULL);
+    remove("bench_script.wsh");
+    printf("Shell startup: %.2f ms\n", baseline * 1e3);
+
+    bench_builtins(iterations, baseline);
+    bench_pipelines(iterations, baseline);
+    bench_plugin(iterations, baseline);
+    bench_walk(baseline);
+    return 0;
+}
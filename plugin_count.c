@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "wsh_plugin.h"
+
+// Sample plugin: count [file...] prints lines, words and bytes like wc.
+// `make plugins` builds it both as count.so, loaded with
+// `enable -f ./count.so count`, and as the standalone binary count-ext.
+
+static int count_fd(int fd, const char *name, WshContext *ctx) {
+    char buf[65536];
+    long long lines = 0, words = 0, bytes = 0;
+    int in_word = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            dprintf(ctx->err, "count: %s: %s\n", name != NULL ? name : "stdin", strerror(errno));
+            return 1;
+        }
+        bytes += n;
+        for (ssize_t i = 0; i < n; i++) {
+            char c = buf[i];
+            lines += c == '\n';
+            int space = c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+            words += !space && !in_word;
+            in_word = !space;
+        }
+    }
+    if (name != NULL) {
+        dprintf(ctx->out, "%lld %lld %lld %s\n", lines, words, bytes, name);
+    } else {
+        dprintf(ctx->out, "%lld %lld %lld\n", lines, words, bytes);
+    }
+    return 0;
+}
+
+static int count_run(int argc, char **argv, WshContext *ctx) {
+    if (argc < 2) {
+        return count_fd(ctx->in, NULL, ctx);
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            dprintf(ctx->err, "count: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        status |= count_fd(fd, argv[i], ctx);
+        close(fd);
+    }
+    return status;
+}
+
+const WshBuiltin count_wsh_builtin = { WSH_PLUGIN_ABI, "count", count_run };
+
+#ifdef WSH_STANDALONE
+int main(int argc, char *argv[]) {
+    WshContext ctx = { WSH_PLUGIN_ABI, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, 0, NULL, NULL };
+    return count_run(argc, argv, &ctx);
+}
+#endif
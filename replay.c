@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Replays a `wsh --record` trace against ./wsh. Build with `make replay`.
+//
+//   ./replay [--speed X | --max] [--sessions N] [--sandbox DIR] trace.jsonl
+//
+// Every session is a ./wsh running the trace's lines as a batch script on
+// stdin, itself run with --record, so latency comes from the shell's own
+// per-command timing rather than pipe round trips. Sessions start in the
+// directory the recording started in, so relative paths resolve as they did
+// then; the sandbox only holds each session's output.log and session.jsonl.
+
+typedef struct {
+    double ts;
+    char *cmd;
+    int status;                 // -1 for function definition lines
+    long long duration_us;
+} TraceLine;
+
+typedef struct {
+    TraceLine *lines;
+    int count;
+    char *cwd;                  // where the recording started, NULL if unknown
+} Trace;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// value of "key": in a one-line JSON object, or NULL
+static const char *json_field(const char *obj, const char *key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(obj, pattern);
+    return p != NULL ? p + strlen(pattern) : NULL;
+}
+
+// decodes the string starting at the opening quote
+static char *json_unquote(const char *p) {
+    char *out = malloc(strlen(p) + 1);
+    size_t n = 0;
+    for (p++; *p != '\0' && *p != '"'; p++) {
+        if (*p != '\\') {
+            out[n++] = *p;
+            continue;
+        }
+        p++;
+        if (*p == 'n') {
+            out[n++] = '\n';
+        } else if (*p == 't') {
+            out[n++] = '\t';
+        } else if (*p == 'u' && strlen(p) >= 5) {
+            char hex[5] = { p[1], p[2], p[3], p[4], '\0' };
+            out[n++] = (char)strtol(hex, NULL, 16);
+            p += 4;
+        } else if (*p != '\0') {
+            out[n++] = *p;
+        } else {
+            break;
+        }
+    }
+    out[n] = '\0';
+    return out;
+}
+
+static int load_trace(const char *path, Trace *trace) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+    int cap = 256;
+    trace->lines = malloc(cap * sizeof(TraceLine));
+    trace->count = 0;
+    trace->cwd = NULL;
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, in) >= 0) {
+        const char *cmd = json_field(line, "cmd");
+        const char *ts = json_field(line, "ts");
+        const char *cwd = json_field(line, "cwd");
+        // the session's start line, or for older traces the first command's cwd
+        if (trace->cwd == NULL && cwd != NULL && *cwd == '"' &&
+            (json_field(line, "start") != NULL || cmd != NULL)) {
+            trace->cwd = json_unquote(cwd);
+        }
+        if (cmd == NULL || ts == NULL || *cmd != '"') {
+            continue;
+        }
+        if (trace->count == cap) {
+            cap *= 2;
+            trace->lines = realloc(trace->lines, cap * sizeof(TraceLine));
+        }
+        TraceLine *t = &trace->lines[trace->count++];
+        t->ts = strtod(ts, NULL);
+        t->cmd = json_unquote(cmd);
+        const char *status = json_field(line, "status");
+        const char *duration = json_field(line, "duration_us");
+        t->status = status != NULL ? atoi(status) : -1;
+        t->duration_us = duration != NULL ? atoll(duration) : 0;
+    }
+    free(line);
+    fclose(in);
+    return 0;
+}
+
+// feeds the trace to one shell, sleeping out the recorded gaps unless speed is 0
+static void drive_session(const Trace *trace, double speed, const char *wsh, const char *dir) {
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        perror("pipe");
+        _exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        _exit(1);
+    }
+    if (pid == 0) {
+        char log_path[PATH_MAX + 32], record_path[PATH_MAX + 32];
+        snprintf(log_path, sizeof(log_path), "%s/output.log", dir);
+        snprintf(record_path, sizeof(record_path), "%s/session.jsonl", dir);
+        if (trace->cwd == NULL || chdir(trace->cwd) != 0) {
+            if (trace->cwd != NULL) {
+                fprintf(stderr, "replay: %s: %s, starting in %s\n", trace->cwd, strerror(errno), dir);
+            }
+            if (chdir(dir) != 0) {
+                perror(dir);
+                _exit(127);
+            }
+        }
+        int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log_fd >= 0) {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        dup2(pipefd[0], STDIN_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execl(wsh, wsh, "--record", record_path, "-", (char *)NULL);
+        perror("exec wsh");
+        _exit(127);
+    }
+    close(pipefd[0]);
+    FILE *to_shell = fdopen(pipefd[1], "w");
+
+    double start = now_seconds();
+    for (int i = 0; i < trace->count; i++) {
+        if (speed > 0) {
+            double due = start + (trace->lines[i].ts - trace->lines[0].ts) / speed;
+            double wait = due - now_seconds();
+            if (wait > 0) {
+                struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+                nanosleep(&ts, NULL);
+            }
+        }
+        fprintf(to_shell, "%s\n", trace->lines[i].cmd);
+        fflush(to_shell);
+    }
+    fclose(to_shell);
+    int status;
+    waitpid(pid, &status, 0);
+    _exit(0);
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(const long long *sorted, int n, double p) {
+    int i = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[i] / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    double speed = 1;
+    int sessions = 1;
+    const char *sandbox = NULL;
+    int argi = 1;
+    while (argi < argc - 1 && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--max") == 0) {
+            speed = 0;
+            argi++;
+        } else if (strcmp(argv[argi], "--speed") == 0 && atof(argv[argi + 1]) > 0) {
+            speed = atof(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--sessions") == 0 && atoi(argv[argi + 1]) > 0) {
+            sessions = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--sandbox") == 0) {
+            sandbox = argv[argi + 1];
+            argi += 2;
+        } else {
+            break;
+        }
+    }
+    if (argi != argc - 1) {
+        fprintf(stderr, "Usage: %s [--speed X | --max] [--sessions N] [--sandbox DIR] trace.jsonl\n", argv[0]);
+        return 1;
+    }
+
+    char wsh[PATH_MAX];
+    if (realpath("./wsh", wsh) == NULL || access(wsh, X_OK) != 0) {
+        fprintf(stderr, "replay: ./wsh not found, run make first\n");
+        return 1;
+    }
+    Trace trace;
+    if (load_trace(argv[argi], &trace) != 0) {
+        return 1;
+    }
+    if (trace.count == 0) {
+        fprintf(stderr, "replay: %s: no commands\n", argv[argi]);
+        return 1;
+    }
+
+    char sandbox_dir[PATH_MAX];
+    if (sandbox == NULL) {
+        snprintf(sandbox_dir, sizeof(sandbox_dir), "/tmp/wsh-replay-XXXXXX");
+        if (mkdtemp(sandbox_dir) == NULL) {
+            perror("mkdtemp");
+            return 1;
+        }
+    } else {
+        snprintf(sandbox_dir, sizeof(sandbox_dir), "%s", sandbox);
+        if (mkdir(sandbox_dir, 0755) != 0 && access(sandbox_dir, W_OK) != 0) {
+            perror(sandbox_dir);
+            return 1;
+        }
+    }
+    // sessions run elsewhere, so their logs need an absolute path
+    char resolved[PATH_MAX];
+    if (realpath(sandbox_dir, resolved) != NULL) {
+        snprintf(sandbox_dir, sizeof(sandbox_dir), "%s", resolved);
+    }
+
+    signal(SIGPIPE, SIG_IGN);  // a session that exits early must not kill its driver
+    double start = now_seconds();
+    for (int s = 0; s < sessions; s++) {
+        char dir[PATH_MAX + 16];
+        snprintf(dir, sizeof(dir), "%s/s%d", sandbox_dir, s);
+        mkdir(dir, 0755);
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            drive_session(&trace, speed, wsh, dir);
+        } else if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+    }
+    while (wait(NULL) > 0) {
+    }
+    double wall = now_seconds() - start;
+
+    // gather what each session recorded, checking statuses against the original
+    int capacity = trace.count * sessions;
+    long long *latencies = malloc(capacity * sizeof(long long));
+    int count = 0, mismatched = 0;
+    for (int s = 0; s < sessions; s++) {
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof(path), "%s/s%d/session.jsonl", sandbox_dir, s);
+        Trace replayed;
+        if (load_trace(path, &replayed) != 0) {
+            continue;
+        }
+        for (int i = 0; i < replayed.count; i++) {
+            if (replayed.lines[i].status < 0) {
+                continue;
+            }
+            if (count < capacity) {
+                latencies[count++] = replayed.lines[i].duration_us;
+            }
+            if (i < trace.count && replayed.lines[i].status != trace.lines[i].status) {
+                mismatched++;
+            }
+            free(replayed.lines[i].cmd);
+        }
+        free(replayed.lines);
+    }
+    if (count == 0) {
+        fprintf(stderr, "replay: no commands completed, see %s/s*/output.log\n", sandbox_dir);
+        return 1;
+    }
+    qsort(latencies, count, sizeof(long long), cmp_ll);
+
+    printf("Sandbox: %s\n", sandbox_dir);
+    if (speed > 0) {
+        printf("Sessions: %d, speed: %gx\n", sessions, speed);
+    } else {
+        printf("Sessions: %d, speed: max\n", sessions);
+    }
+    printf("Commands: %d in %.3f s, %.1f commands/s\n", count, wall, count / wall);
+    printf("Latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n", percentile_ms(latencies, count, 50),
+           percentile_ms(latencies, count, 90), percentile_ms(latencies, count, 99), latencies[count - 1] / 1e3);
+    printf("Status mismatches: %d\n", mismatched);
+    return 0;
+}
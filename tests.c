@@ -13,6 +13,8 @@ void run_history_test();
 void run_history_set_test();
 void run_history_execution_test();
 
+// failed checks so far; a failure is reported and the suite moves on
+static int failures = 0;
 
 int main() {
     int result;
@@ -47,6 +49,80 @@ int main() {
 
     run_test("./wsh invalid_cmd.wsh");
 
+    // Profile a batch run into folded stacks (source:line command count) and a summary
+    run_test("./wsh --profile profile.folded script.wsh && test -s profile.folded && ! grep -Ev '^script\\.wsh:[0-9]+ .* [0-9]+$' profile.folded && grep -q '^ *calls *wall_ms' profile.folded.summary");
+
+    // Export metrics in the Prometheus text format
+    run_test("./wsh --metrics-file metrics.prom script.wsh && grep -q '^wsh_forks_total' metrics.prom");
+
+    // Record every command line with its status and duration
+    run_test("./wsh --record trace.jsonl script.wsh && grep -q '\"duration_us\"' trace.jsonl");
+
+    // A trace starts with the directory the session started in
+    run_test("head -n 1 trace.jsonl | grep -qF \"\\\"cwd\\\":\\\"$PWD\\\",\\\"start\\\":true\"");
+
+    // - runs a batch script read from stdin, without prompts
+    run_test("test \"$(printf 'echo one\\necho two\\n' | ./wsh -)\" = \"$(printf 'one\\ntwo')\"");
+
+    // Argument lists past the old 64 word limit
+    result = system("seq -s ' ' 5000 | sed 's|^|/bin/echo |' > long_args.wsh");
+    if (result != 0) { perror("Error creating long_args.wsh"); return result; }
+    run_test("./wsh long_args.wsh | grep -q ' 5000$'");
+
+    // Jump to a visited directory by fragment
+    result = system("printf 'export WSH_JUMP_FILE=/tmp/wsh_jump_test\\ncd /tmp\\ncd /\\nj tmp\\npwd\\n' > jump.wsh");
+    if (result != 0) { perror("Error creating jump.wsh"); return result; }
+    run_test("./wsh jump.wsh | grep -qx /tmp");
+
+    // A damaged index (entry 0's path offset far past the pool) is rebuilt rather than read
+    run_test("printf '\\0\\377\\377\\377' | dd of=/tmp/wsh_jump_test bs=1 seek=12344 conv=notrunc 2>/dev/null && ./wsh jump.wsh | grep -qx /tmp");
+
+    // Batch scripts leave no index in $HOME unless they set WSH_JUMP_FILE
+    run_test("mkdir -p jump_home && HOME=$PWD/jump_home ./wsh -c 'cd /tmp' && test ! -e jump_home/.wsh_jump && rmdir jump_home");
+
+    // Redirect through gzip and read it back
+    result = system("echo '/bin/echo hello > gz_test.gz' > gz.wsh && echo '/bin/cat < gz_test.gz' >> gz.wsh");
+    if (result != 0) { perror("Error creating gz.wsh"); return result; }
+    run_test("./wsh gz.wsh | grep -q hello && zcat gz_test.gz | grep -q hello");
+
+    // Arithmetic expansion with assignment
+    result = system("printf 'local i=5\\necho $((i += 2)) $((i * 2 + 1)) $((i > 6 ? 1 : 0))\\n' > arith.wsh");
+    if (result != 0) { perror("Error creating arith.wsh"); return result; }
+    run_test("./wsh arith.wsh | grep -qx '7 15 1'");
+
+    // Read fields from a file, leaving the rest for the next command
+    result = system("printf 'read a b\\necho $b $a\\n/bin/cat\\n' > read.wsh && printf 'one two three\\nnext\\n' > read_input.txt");
+    if (result != 0) { perror("Error creating read.wsh"); return result; }
+    run_test("./wsh read.wsh < read_input.txt | tr '\\n' ' ' | grep -qx 'two three one next '");
+
+    // Appends keep going to the right file when it is replaced
+    result = system("printf 'echo one >> append.log\\n/bin/mv append.log append.old\\necho two >> append.log\\n' > append.wsh");
+    if (result != 0) { perror("Error creating append.wsh"); return result; }
+    run_test("./wsh append.wsh && grep -qx one append.old && grep -qx two append.log");
+
+    // A bare exec keeps its redirection, exec cmd replaces the shell
+    result = system("printf 'exec > exec_out.txt\\necho kept\\nexec /bin/echo replaced\\necho not reached\\n' > exec.wsh");
+    if (result != 0) { perror("Error creating exec.wsh"); return result; }
+    run_test("./wsh exec.wsh && test \"$(cat exec_out.txt)\" = \"$(printf 'kept\\nreplaced')\"");
+
+    // A memoized command runs once and is replayed after that
+    result = system("printf 'export WSH_MEMO_DIR=/tmp/wsh_memo_test\\nmemo /bin/sh memo_cmd.sh\\nmemo /bin/sh memo_cmd.sh\\n' > memo.wsh && echo 'date +%N >> memo_runs.txt; echo cached' > memo_cmd.sh");
+    if (result != 0) { perror("Error creating memo.wsh"); return result; }
+    run_test("./wsh memo.wsh | grep -c cached | grep -qx 2 && test $(wc -l < memo_runs.txt) -eq 1");
+
+    // Pipelines mixing threaded builtins and external commands, and a background job
+    result = system("printf 'echo piped | /bin/tr a-z A-Z\\necho skipped | echo second\\necho bg > pipe_bg.txt &\\nwait\\n/bin/cat pipe_bg.txt\\n' > pipe.wsh");
+    if (result != 0) { perror("Error creating pipe.wsh"); return result; }
+    run_test("test \"$(./wsh pipe.wsh | tr '\\n' ' ')\" = 'PIPED second bg '");
+
+    // A background builtin on the script's last line still finishes after the shell exits
+    run_test("test \"$(./wsh -c 'walk -s /usr &' | wc -l)\" -eq \"$(./wsh -c 'walk -s /usr' | wc -l)\"");
+
+    // A builtin loaded from the sample plugin runs in-process with redirections
+    result = system("make -s count.so && printf 'enable -f ./count.so count\\nprintf %%s\\\\n a b c > plugin_in.txt\\ncount < plugin_in.txt\\n' > plugin.wsh");
+    if (result != 0) { perror("Error creating plugin.wsh"); return result; }
+    run_test("test \"$(./wsh plugin.wsh)\" = '3 3 6'");
+
     // Comment tests:
     printf("\nRunning comment tests:\n");
 
@@ -96,6 +172,15 @@ int main() {
     if (result != 0) { perror("Error creating test_output.txt"); return result; }
     run_redirection_test("/bin/ls non_existent_file &>> test_output.txt", "test_output.txt", "initial output\n/bin/ls: cannot access 'non_existent_file': No such file or directory\n");
 
+    // Duplicate a descriptor (N>&M)
+    printf("Test: Duplicate file descriptor\n");
+    run_redirection_test("/bin/echo dup 2> test_output.txt 1>&2", "test_output.txt", "dup\n");
+
+    // Process substitution
+    printf("Test: Process substitution\n");
+    run_path_test("/bin/cat <(echo from sub)", "from sub\n");
+    run_redirection_test("echo to sub > >(/bin/cat > test_output.txt)", "test_output.txt", "to sub\n");
+
     // Variable tests:
     printf("\nRunning variable tests:\n");
 
@@ -134,20 +219,75 @@ int main() {
     printf("Test 23: Non-existent command\n");
     run_path_test("nonexistentcmd", "nonexistentcmd: command not found\n");
 
+    // Walk tests:
+    printf("\nRunning walk tests:\n");
+
+    // Walk with depth limit prints only the root
+    printf("Test: Walk depth limit\n");
+    run_path_test("walk -maxdepth 0 .", ".\n");
+
+    // Walk name and type filters
+    printf("Test: Walk filters\n");
+    result = system("mkdir -p walk_dir/sub && touch walk_dir/sub/a.txt walk_dir/b.log");
+    if (result != 0) { perror("Error creating walk_dir"); return result; }
+    run_path_test("walk -s walk_dir -type f -name *.txt", "walk_dir/sub/a.txt\n");
+    result = system("rm -r walk_dir");
+    if (result != 0) { perror("Error removing walk_dir"); return result; }
+
+    // run applies options and rejects unknown ones
+    printf("Test: run builtin\n");
+    run_path_test("run --nice 5 /bin/echo niced", "niced\n");
+    run_path_test("run --bogus 1 /bin/echo", "wsh: run: invalid option --bogus\n");
+
+    // Builtin utility tests:
+    printf("\nRunning builtin utility tests:\n");
+
+    // echo and printf run in-process
+    printf("Test: echo and printf builtins\n");
+    run_path_test("echo -n a b\necho c", "a bc\n");
+    run_path_test("printf %s=%03d\\n x 7", "x=007\n");
+
+    // test and [ drive the exit status
+    printf("Test: test builtin\n");
+    run_path_test("[ 2 -gt 1 ]", "");
+    run_path_test("test x -eq 1", "wsh: test: x: integer expression expected\n");
+    run_redirection_test("test -d /nonexistent > test_output.txt", "test_output.txt", "");
+
+    // timeout stops a hung command and the batch continues
+    printf("Test: timeout builtin\n");
+    run_path_test("timeout 0.1 /bin/sleep 5\necho after", "after\n");
+
+    // Function tests:
+    printf("\nRunning function tests:\n");
+
+    // Define and call a function with positional parameters
+    printf("Test: Function call\n");
+    run_path_test("greet() { echo hi $1 of $#; }\ngreet there", "hi there of 1\n");
+
+    // a body may define another function; its ; stay inside its braces
+    printf("Test: Nested function definition\n");
+    run_path_test("outer() { inner() { local w=$1; echo in $w; }; inner x; }\nouter", "in x\n");
+
+    // local inside a function is restored on return
+    printf("Test: Function local scope\n");
+    run_variable_test("local v=outer\nset_v() {\n local v=inner\n}\nset_v\necho $v\n", "outer\n");
+
     // Test 24: History command
     run_history_test();
     run_history_set_test();
     run_history_execution_test();
     
-    printf("All tests finished.\n");
+    printf("All tests finished, %d failed.\n", failures);
 
     
     // Cleanup
-    result = system("rm script.wsh empty.wsh invalid_cmd.wsh output.txt test_script.wsh test_output.txt test_input.txt");
+    result = system("rm -f script.wsh empty.wsh invalid_cmd.wsh profile.folded profile.folded.summary metrics.prom trace.jsonl long_args.wsh gz.wsh gz_test.gz jump.wsh arith.wsh read.wsh read_input.txt append.wsh append.log append.old exec.wsh exec_out.txt memo.wsh memo_cmd.sh memo_runs.txt pipe.wsh pipe_bg.txt plugin.wsh plugin_in.txt count.so /tmp/wsh_jump_test output.txt test_script.wsh test_output.txt test_input.txt");
     if (result != 0) { perror("Error cleaning up test files"); return result; }
+    result = system("rm -rf /tmp/wsh_memo_test");
+    if (result != 0) { perror("Error cleaning up memo store"); return result; }
 
     
-    return 0;
+    return failures == 0 ? 0 : 1;
 }
 
 // Run a batch mode test
@@ -156,6 +296,7 @@ void run_test(const char *cmd) {
     int result = system(cmd);
     if (result != 0) {
         printf("Test failed with status %d.\n", result);
+        failures++;
     } else {
         printf("Test passed.\n");
     }
@@ -167,7 +308,8 @@ void run_comment_test(const char *input, const char *expected_output) {
     FILE *script_file = fopen("test_script.wsh", "w");
     if (script_file == NULL) {
         perror("Failed to create test script");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Write the input line to the script file
@@ -176,16 +318,18 @@ void run_comment_test(const char *input, const char *expected_output) {
 
     // Run the shell in batch mode with the test script and check the result of system()
     int result = system("./wsh test_script.wsh > output.txt");
-    if (result != 0) {
+    if (result == -1) {
         perror("Failed to run wsh on test script");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Open the output file
     FILE *output_file = fopen("output.txt", "r");
     if (output_file == NULL) {
         perror("Failed to open output file");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Read the actual output from the shell
@@ -193,7 +337,8 @@ void run_comment_test(const char *input, const char *expected_output) {
     if (fgets(actual_output, sizeof(actual_output), output_file) == NULL && !feof(output_file)) {
         perror("Failed to read from output file");
         fclose(output_file);
-        exit(1);
+        failures++;
+        return;
     }
     fclose(output_file);
 
@@ -202,6 +347,7 @@ void run_comment_test(const char *input, const char *expected_output) {
         printf("Comment test passed: '%s'\n", input);
     } else {
         printf("Comment test failed: '%s'\nExpected: '%s', but got: '%s'\n", input, expected_output, actual_output);
+        failures++;
     }
 
     // Clean up the temporary files
@@ -215,7 +361,8 @@ void run_redirection_test(const char *cmd, const char *expected_output_file, con
     FILE *script_file = fopen("test_script.wsh", "w");
     if (script_file == NULL) {
         perror("Failed to create test script");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Write the command to the script file
@@ -224,16 +371,18 @@ void run_redirection_test(const char *cmd, const char *expected_output_file, con
 
     // Run the shell in batch mode with the test script
     int result = system("./wsh test_script.wsh");
-    if (result != 0) {
+    if (result == -1) {
         perror("Failed to run shell command");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Open the output file and check its contents
     FILE *output_file = fopen(expected_output_file, "r");
     if (output_file == NULL) {
         perror("Failed to open output file");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Read the contents of the output file
@@ -242,7 +391,8 @@ void run_redirection_test(const char *cmd, const char *expected_output_file, con
     if (bytes_read == 0 && !feof(output_file)) {
         perror("Failed to read from output file");
         fclose(output_file);
-        exit(1);
+        failures++;
+        return;
     }
     fclose(output_file);
 
@@ -251,6 +401,7 @@ void run_redirection_test(const char *cmd, const char *expected_output_file, con
         printf("Test passed: %s\n", cmd);
     } else {
         printf("Test failed: %s\nExpected: '%s', but got: '%s'\n", cmd, expected_content, actual_content);
+        failures++;
     }
 
     // Clean up the temporary script file
@@ -265,7 +416,8 @@ void run_variable_test(const char *cmd, const char *expected_output) {
     FILE *script_file = fopen("test_script.wsh", "w");
     if (script_file == NULL) {
         perror("Failed to create test script");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Write the command to the script file
@@ -274,16 +426,18 @@ void run_variable_test(const char *cmd, const char *expected_output) {
 
     // Run the shell in batch mode and redirect the output
     int result = system("./wsh test_script.wsh > output.txt");
-    if (result != 0) {
+    if (result == -1) {
         perror("Failed to run wsh on test script");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Open the output file
     FILE *output_file = fopen("output.txt", "r");
     if (output_file == NULL) {
         perror("Failed to open output file");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Read the actual output from the shell
@@ -291,7 +445,8 @@ void run_variable_test(const char *cmd, const char *expected_output) {
     if (fgets(actual_output, sizeof(actual_output), output_file) == NULL && !feof(output_file)) {
         perror("Failed to read from output file");
         fclose(output_file);
-        exit(1);
+        failures++;
+        return;
     }
     fclose(output_file);
 
@@ -300,6 +455,7 @@ void run_variable_test(const char *cmd, const char *expected_output) {
         printf("Variable test passed: '%s'\n", cmd);
     } else {
         printf("Variable test failed: '%s'\nExpected: '%s', but got: '%s'\n", cmd, expected_output, actual_output);
+        failures++;
     }
 
     // Clean up temporary files
@@ -312,7 +468,8 @@ void run_path_test(const char *cmd, const char *expected_output) {
     FILE *script_file = fopen("test_script.wsh", "w");
     if (script_file == NULL) {
         perror("Failed to create test script");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Write the command to the script file
@@ -323,6 +480,7 @@ void run_path_test(const char *cmd, const char *expected_output) {
     int result = system("./wsh test_script.wsh > output.txt 2>&1");  // Capture both stdout and stderr
     if (result != 0 && expected_output == NULL) {
         printf("Test failed for command: %s\n", cmd);
+        failures++;
         return;
     }
 
@@ -330,7 +488,8 @@ void run_path_test(const char *cmd, const char *expected_output) {
     FILE *output_file = fopen("output.txt", "r");
     if (output_file == NULL) {
         perror("Failed to open output file");
-        exit(1);
+        failures++;
+        return;
     }
 
     // Read the actual output from the shell
@@ -338,7 +497,8 @@ void run_path_test(const char *cmd, const char *expected_output) {
     if (fgets(actual_output, sizeof(actual_output), output_file) == NULL && !feof(output_file)) {
         perror("Failed to read from output file");
         fclose(output_file);
-        exit(1);
+        failures++;
+        return;
     }
     fclose(output_file);
 
@@ -349,6 +509,7 @@ void run_path_test(const char *cmd, const char *expected_output) {
         printf("Test passed: %s (no output expected)\n", cmd);
     } else {
         printf("Test failed: %s\nExpected: '%s', but got: '%s'\n", cmd, expected_output, actual_output);
+        failures++;
     }
 
     // Clean up
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "wsh.h"
+#include "wsh_plugin.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,6 +13,28 @@
 #include <stdbool.h>
 #include <locale.h>
 #include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <wchar.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <sys/sendfile.h>
+#include <semaphore.h>
+#include <dlfcn.h>
 
 #define MAX_HISTORY_SIZE 100
 #define DEFAULT_HISTORY_SIZE 5
@@ -25,521 +49,7172 @@ bool should_exit = false;
 bool path_invalid = false;
 int interactive_mode = 0;
 
+// builtins print here: stdout, or their own stream when they run on a pipeline thread
+static __thread FILE *builtin_out = NULL;
+
+static FILE *builtin_stdout() {
+    return builtin_out != NULL ? builtin_out : stdout;
+}
+
 // xtra funcs
 bool is_builtin_command(char *cmd);  
 char *trimmer(char *str);
 int process_history_builtin(char **args);
 int cmp_entries(const void *a, const void *b);
+int read_interactive_line(const char *prompt, char **line, size_t *size);
 
-// infinte shell loop 
-void shell_loop() {
-    char line[MAX_LINE];
+// prefix trie over every executable found in PATH
+typedef struct TrieNode {
+    char ch;
+    int terminal;               // number of PATH dirs providing this name
+    struct TrieNode *child;     // first child, kept sorted by ch
+    struct TrieNode *next;      // next sibling
+} TrieNode;
 
-    while (1) {
-        if (interactive_mode) {
-            printf("wsh> ");
-            fflush(stdout); 
+// per-directory cache so only changed PATH dirs get rescanned
+typedef struct {
+    char *dir;
+    struct timespec mtime;
+    char **names;
+    int count;
+    bool in_path;
+} PathDirCache;
+
+static TrieNode exec_trie;
+static PathDirCache *path_dirs = NULL;
+static int path_dir_count = 0;
+
+static TrieNode *trie_child(TrieNode *node, char ch, bool create) {
+    TrieNode **link = &node->child;
+    while (*link != NULL && (unsigned char)(*link)->ch < (unsigned char)ch) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL && (*link)->ch == ch) {
+        return *link;
+    }
+    if (!create) {
+        return NULL;
+    }
+    TrieNode *n = calloc(1, sizeof(TrieNode));
+    if (n == NULL) {
+        return NULL;
+    }
+    n->ch = ch;
+    n->next = *link;
+    *link = n;
+    return n;
+}
+
+static void trie_insert(const char *name) {
+    TrieNode *node = &exec_trie;
+    for (const char *p = name; *p != '\0' && node != NULL; p++) {
+        node = trie_child(node, *p, true);
+    }
+    if (node != NULL) {
+        node->terminal++;
+    }
+}
+
+// nodes are left in place on removal, a later rescan usually reuses them
+static void trie_remove(const char *name) {
+    TrieNode *node = &exec_trie;
+    for (const char *p = name; *p != '\0' && node != NULL; p++) {
+        node = trie_child(node, *p, false);
+    }
+    if (node != NULL && node->terminal > 0) {
+        node->terminal--;
+    }
+}
+
+static void path_dir_clear(PathDirCache *pd) {
+    for (int i = 0; i < pd->count; i++) {
+        trie_remove(pd->names[i]);
+        free(pd->names[i]);
+    }
+    free(pd->names);
+    pd->names = NULL;
+    pd->count = 0;
+}
+
+// false when memory ran out part way; the names found so far stay indexed
+static bool path_dir_scan(PathDirCache *pd) {
+    path_dir_clear(pd);
+    DIR *dir = opendir(pd->dir);
+    if (dir == NULL) {
+        return true;
+    }
+    bool complete = true;
+    int dfd = dirfd(dir);
+    int cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
         }
+        if (entry->d_type == DT_DIR) {
+            continue;
+        }
+        if (faccessat(dfd, entry->d_name, X_OK, 0) != 0) {
+            continue;
+        }
+        if (pd->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(pd->names, cap * sizeof(char *));
+            if (grown == NULL) {
+                complete = false;
+                break;
+            }
+            pd->names = grown;
+        }
+        pd->names[pd->count] = strdup(entry->d_name);
+        if (pd->names[pd->count] == NULL) {
+            complete = false;
+            break;
+        }
+        trie_insert(pd->names[pd->count]);
+        pd->count++;
+    }
+    closedir(dir);
+    return complete;
+}
 
-        if (fgets(line, sizeof(line), stdin) == NULL) {
-            if (feof(stdin)) {
+// lazily (re)build the trie, rescanning only dirs whose mtime moved
+static void exec_index_refresh() {
+    char *path_env = getenv("PATH");
+    for (int i = 0; i < path_dir_count; i++) {
+        path_dirs[i].in_path = false;
+    }
+
+    char *path_copy = strdup(path_env ? path_env : "");
+    if (path_copy == NULL) {
+        return;
+    }
+    char *saveptr = NULL;
+    for (char *dir = strtok_r(path_copy, ":", &saveptr); dir != NULL; dir = strtok_r(NULL, ":", &saveptr)) {
+        PathDirCache *pd = NULL;
+        for (int i = 0; i < path_dir_count; i++) {
+            if (strcmp(path_dirs[i].dir, dir) == 0) {
+                pd = &path_dirs[i];
                 break;
             }
+        }
+        if (pd != NULL && pd->in_path) {
+            continue;  // listed twice in PATH
+        }
+
+        struct stat st;
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
             continue;
         }
-        line[strcspn(line, "\n")] = '\0';
-        char *trimmed_line = line;
-        while (*trimmed_line == ' ' || *trimmed_line == '\t') {
-            trimmed_line++;  
+        if (pd == NULL) {
+            PathDirCache *grown = realloc(path_dirs, (path_dir_count + 1) * sizeof(PathDirCache));
+            if (grown == NULL) {
+                break;
+            }
+            path_dirs = grown;
+            char *copy = strdup(dir);
+            if (copy == NULL) {
+                break;
+            }
+            pd = &path_dirs[path_dir_count++];
+            memset(pd, 0, sizeof(*pd));
+            pd->dir = copy;
+            pd->mtime.tv_sec = -1;
         }
-        if (trimmed_line[0] == '#' || trimmed_line[0] == '\0') {
-            continue;  
+        pd->in_path = true;
+        if (pd->mtime.tv_sec != st.st_mtim.tv_sec || pd->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+            if (path_dir_scan(pd)) {
+                pd->mtime = st.st_mtim;  // a partial scan is retried next time
+            }
         }
+    }
+    free(path_copy);
 
-        if (strcmp(trimmed_line, "exit") == 0) {
+    // drop dirs that left PATH
+    int kept = 0;
+    for (int i = 0; i < path_dir_count; i++) {
+        if (path_dirs[i].in_path) {
+            path_dirs[kept++] = path_dirs[i];
+        } else {
+            path_dir_clear(&path_dirs[i]);
+            free(path_dirs[i].dir);
+        }
+    }
+    path_dir_count = kept;
+}
+
+// candidates gathered for one tab press
+typedef struct {
+    char **items;
+    int count;
+    int cap;
+    char *common;       // longest common prefix of all items
+} Completion;
+
+// appends without checking for duplicates; completion_finish drops them
+static void completion_add(Completion *c, const char *item) {
+    if (c->count == c->cap) {
+        int cap = c->cap ? c->cap * 2 : 16;
+        char **grown = realloc(c->items, cap * sizeof(char *));
+        if (grown == NULL) {
+            return;
+        }
+        c->items = grown;
+        c->cap = cap;
+    }
+    c->items[c->count++] = strdup(item);
+
+    if (c->common == NULL) {
+        c->common = strdup(item);
+    } else {
+        size_t n = 0;
+        while (c->common[n] != '\0' && c->common[n] == item[n]) {
+            n++;
+        }
+        c->common[n] = '\0';
+    }
+}
+
+// sorts the items and drops duplicates, once all sources have been added
+static void completion_finish(Completion *c) {
+    qsort(c->items, c->count, sizeof(char *), cmp_entries);
+    int kept = 0;
+    for (int i = 0; i < c->count; i++) {
+        if (kept > 0 && strcmp(c->items[kept - 1], c->items[i]) == 0) {
+            free(c->items[i]);
+            continue;
+        }
+        c->items[kept++] = c->items[i];
+    }
+    c->count = kept;
+}
+
+static void completion_free(Completion *c) {
+    for (int i = 0; i < c->count; i++) {
+        free(c->items[i]);
+    }
+    free(c->items);
+    free(c->common);
+    memset(c, 0, sizeof(*c));
+}
+
+static void trie_collect(TrieNode *node, char *buf, size_t depth, size_t size, Completion *c) {
+    if (node->terminal > 0) {
+        buf[depth] = '\0';
+        completion_add(c, buf);
+    }
+    if (depth + 1 >= size) {
+        return;
+    }
+    for (TrieNode *child = node->child; child != NULL; child = child->next) {
+        buf[depth] = child->ch;
+        trie_collect(child, buf, depth + 1, size, c);
+    }
+}
+
+static void complete_command(const char *prefix, Completion *c) {
+    size_t len = strlen(prefix);
+    for (const Builtin *b = builtin_table; b->name != NULL; b++) {
+        if (strncmp(b->name, prefix, len) == 0) {
+            completion_add(c, b->name);
+        }
+    }
+
+    exec_index_refresh();
+    TrieNode *node = &exec_trie;
+    for (size_t i = 0; i < len && node != NULL; i++) {
+        node = trie_child(node, prefix[i], false);
+    }
+    if (node == NULL) {
+        return;
+    }
+    char buf[PATH_MAX];
+    memcpy(buf, prefix, len);
+    trie_collect(node, buf, len, sizeof(buf), c);
+}
+
+static void complete_variable(const char *prefix, Completion *c) {
+    extern char **environ;
+    size_t len = strlen(prefix);
+    char name[PATH_MAX];
+
+    for (int i = 0; i < var_count; i++) {
+        if (strncmp(shell_vars[i].name, prefix, len) == 0) {
+            completion_add(c, shell_vars[i].name);
+        }
+    }
+    for (char **env = environ; *env != NULL; env++) {
+        size_t n = strcspn(*env, "=");
+        if (n >= len && n < sizeof(name) && strncmp(*env, prefix, len) == 0) {
+            memcpy(name, *env, n);
+            name[n] = '\0';
+            completion_add(c, name);
+        }
+    }
+}
+
+// streams entries of the word's directory, keeping only prefix matches
+static void complete_filename(const char *word, Completion *c) {
+    const char *slash = strrchr(word, '/');
+    char dir_path[PATH_MAX];
+    const char *base = word;
+    size_t dir_len = 0;
+
+    if (slash != NULL) {
+        dir_len = slash - word + 1;
+        base = slash + 1;
+        if (dir_len >= sizeof(dir_path)) {
+            return;
+        }
+        memcpy(dir_path, word, dir_len);
+        dir_path[dir_len] = '\0';
+    } else {
+        strcpy(dir_path, ".");
+    }
+
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    size_t base_len = strlen(base);
+    char candidate[PATH_MAX];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (entry->d_name[0] == '.' && base[0] != '.') {
+            continue;
+        }
+        if (strncmp(entry->d_name, base, base_len) != 0) {
+            continue;
+        }
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat st;
+            is_dir = fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        snprintf(candidate, sizeof(candidate), "%.*s%s%s", (int)dir_len, word, entry->d_name, is_dir ? "/" : "");
+        completion_add(c, candidate);
+    }
+    closedir(dir);
+}
+
+// fills c with candidates for the word ending at line[len]; returns word start
+static size_t complete_word(const char *line, size_t len, Completion *c, bool *is_name) {
+    size_t start = len;
+    while (start > 0 && line[start - 1] != ' ' && line[start - 1] != '\t') {
+        start--;
+    }
+    bool first_word = true;
+    for (size_t i = 0; i < start; i++) {
+        if (line[i] != ' ' && line[i] != '\t') {
+            first_word = false;
             break;
         }
+    }
 
-        process_cmd(trimmed_line, true);
+    char word[PATH_MAX];
+    snprintf(word, sizeof(word), "%.*s", (int)(len - start), line + start);
+
+    *is_name = true;
+    if (word[0] == '$') {
+        complete_variable(word + 1, c);
+        return start + 1;
+    }
+    if (first_word && strchr(word, '/') == NULL) {
+        complete_command(word, c);
+        return start;
     }
+    *is_name = false;
+    complete_filename(word, c);
+    return start;
 }
 
+static struct termios saved_termios;
+static bool raw_mode_on = false;
 
-void process_cmd(char *cmd, bool add_to_history) {
-    char *args[MAX_ARGS];
-    int i = 0;
-    int saved_stdout = -1;
-    int saved_stdin = -1;
-    int  saved_stderr = -1;
-    char *redirection_files[3] = {NULL, NULL, NULL}; 
-    int redirection_types[3] = {0, 0, 0};            
+static void disable_raw_mode() {
+    if (raw_mode_on) {
+        const char *off = "\x1b[?2004l";  // bracketed paste off
+        if (write(STDOUT_FILENO, off, strlen(off)) < 0) {
+            // terminal is gone, nothing to restore
+        }
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &saved_termios);
+        raw_mode_on = false;
+    }
+}
 
-    char original_cmd[MAX_LINE];
-    strncpy(original_cmd, cmd, sizeof(original_cmd) - 1);
-    original_cmd[sizeof(original_cmd) - 1] = '\0';
+static int enable_raw_mode() {
+    static bool registered = false;
+    if (tcgetattr(STDIN_FILENO, &saved_termios) != 0) {
+        return -1;
+    }
+    if (!registered) {
+        atexit(disable_raw_mode);
+        registered = true;
+    }
+    struct termios raw = saved_termios;
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | ISTRIP | INPCK);
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) != 0) {
+        return -1;
+    }
+    raw_mode_on = true;
+    const char *on = "\x1b[?2004h";  // bracketed paste on
+    if (write(STDOUT_FILENO, on, strlen(on)) < 0) {
+        disable_raw_mode();
+        return -1;
+    }
+    return 0;
+}
 
-    if (add_to_history) {
-        history_add(original_cmd);
-    }
-
-    char cmd_copy[MAX_LINE];
-    strncpy(cmd_copy, cmd, sizeof(cmd_copy) - 1);
-    cmd_copy[sizeof(cmd_copy) - 1] = '\0';
-
-    char *token = strtok(cmd_copy, " ");
-    while (token != NULL && i < MAX_ARGS) {
-        if (strcmp(token, "<") == 0 || strncmp(token, "<", 1) == 0 ||
-            strcmp(token, ">") == 0 || strncmp(token, ">", 1) == 0 ||
-            strcmp(token, ">>") == 0 || strncmp(token, ">>", 2) == 0 ||
-            strncmp(token, "2>", 2) == 0 || strncmp(token, "1>", 2) == 0 || strncmp(token, "0>", 2) == 0) {
-            char *redirection = token;
-            char *file = NULL;
-
-            // if with space
-            if (strcmp(redirection, "<") == 0) {
-                redirection_types[0] = 1;  
-                token = strtok(NULL, " ");
-                if (token == NULL) {
-                    if (!interactive_mode) {
-                        fprintf(stderr, "wsh: syntax error near unexpected token `newline'\n");
-                    }
-                    return;
-                }
-                redirection_files[0] = token;
-            } else if (strncmp(redirection, "<", 1) == 0) {
-                // if no space
-                redirection_types[0] = 1;  
-                file = redirection + 1;
-                if (*file == '\0') {
-                    if (!interactive_mode) {
-                        fprintf(stderr, "wsh: syntax error near unexpected token `newline'\n");
-                    }
-                    return;
-                }
-                redirection_files[0] = file;
-            } else if (strcmp(redirection, ">") == 0) {
-                redirection_types[1] = 1;  
-                token = strtok(NULL, " ");
-                if (token == NULL) {
-                    if (!interactive_mode) {
-                        fprintf(stderr, "wsh: syntax error near unexpected token `newline'\n");
-                    }
-                    return;
-                }
-                redirection_files[1] = token;
-            } else if (strncmp(redirection, ">", 1) == 0 && strncmp(redirection, ">>", 2) != 0) {
-                redirection_types[1] = 1;  
-                file = redirection + 1;
-                if (*file == '\0') {
-                    if (!interactive_mode) {
-                        fprintf(stderr, "wsh: syntax error near unexpected token `newline'\n");
-                    }
-                    return;
-                }
-                redirection_files[1] = file;
-            } else if (strcmp(redirection, ">>") == 0) {
-                redirection_types[1] = 2;  
-                token = strtok(NULL, " ");
-                if (token == NULL) {
-                    if (!interactive_mode) {
-                        fprintf(stderr, "wsh: syntax error near unexpected token `newline'\n");
-                    }
-                    return;
-                }
-                redirection_files[1] = token;
-            } else if (strncmp(redirection, ">>", 2) == 0) {
-                // append no space
-                redirection_types[1] = 2;  
-                file = redirection + 2;
-                if (*file == '\0') {
-                    if (!interactive_mode) {
-                        fprintf(stderr, "wsh: syntax error near unexpected token `newline'\n");
-                    }
-                    return;
-                }
-                redirection_files[1] = file;
-            } else if (strncmp(redirection, "2>", 2) == 0) {
-                // stderr 
-                redirection_types[2] = 1;  
-                file = redirection + 2;
-                if (*file == '\0') {
-                    token = strtok(NULL, " ");
-                    if (token == NULL) {
-                        if (!interactive_mode) {
-                            fprintf(stderr, "wsh: syntax error near unexpected token `newline'\n");
-                        }
-                        return;
-                    }
-                    redirection_files[2] = token;
-                } else {
-                    redirection_files[2] = file;
-                }
+static void write_str(const char *s) {
+    size_t len = strlen(s);
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, s, len);
+        if (n <= 0) {
+            return;
+        }
+        s += n;
+        len -= n;
+    }
+}
+
+// utf-8 helpers, the editor keeps the cursor on codepoint boundaries
+static bool utf8_cont(char c) {
+    return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+static size_t utf8_prev(const char *s, size_t pos) {
+    if (pos == 0) {
+        return 0;
+    }
+    pos--;
+    while (pos > 0 && utf8_cont(s[pos])) {
+        pos--;
+    }
+    return pos;
+}
+
+static size_t utf8_next(const char *s, size_t len, size_t pos) {
+    if (pos >= len) {
+        return len;
+    }
+    pos++;
+    while (pos < len && utf8_cont(s[pos])) {
+        pos++;
+    }
+    return pos;
+}
+
+// terminal columns taken by s[0..n)
+static size_t text_width(const char *s, size_t n) {
+    size_t cols = 0;
+    size_t i = 0;
+    while (i < n) {
+        unsigned char c = s[i];
+        size_t next = utf8_next(s, n, i);
+        wchar_t wc = c;
+        if (c >= 0xC0) {
+            int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+            wc = c & (0x3F >> extra);
+            for (size_t j = i + 1; j < next; j++) {
+                wc = (wc << 6) | (s[j] & 0x3F);
+            }
+        }
+        int w = wcwidth(wc);
+        cols += w < 0 ? 1 : (size_t)w;
+        i = next;
+    }
+    return cols;
+}
+
+// output for one keypress is gathered here and sent with a single write
+typedef struct {
+    char data[4096];
+    size_t len;
+} OutBuf;
+
+static void out_flush(OutBuf *o) {
+    size_t done = 0;
+    while (done < o->len) {
+        ssize_t n = write(STDOUT_FILENO, o->data + done, o->len - done);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
             }
+            break;
+        }
+        done += n;
+    }
+    o->len = 0;
+}
+
+static void out_append(OutBuf *o, const char *s, size_t n) {
+    while (n > 0) {
+        if (o->len == sizeof(o->data)) {
+            out_flush(o);
+        }
+        size_t chunk = sizeof(o->data) - o->len;
+        if (chunk > n) {
+            chunk = n;
+        }
+        memcpy(o->data + o->len, s, chunk);
+        o->len += chunk;
+        s += chunk;
+        n -= chunk;
+    }
+}
+
+// moves the terminal cursor by delta columns with the shortest sequence
+static void out_move(OutBuf *o, long delta) {
+    char seq[32];
+    if (delta == 0) {
+        return;
+    }
+    if (delta == -1) {
+        out_append(o, "\b", 1);
+        return;
+    }
+    int n = snprintf(seq, sizeof(seq), "\x1b[%ld%c", delta < 0 ? -delta : delta, delta < 0 ? 'D' : 'C');
+    out_append(o, seq, n);
+}
+
+// moves the terminal cursor between two offsets into a line that wraps every
+// width columns, rows first
+static void out_goto(OutBuf *o, size_t from, size_t to, size_t width) {
+    long rows = (long)(to / width) - (long)(from / width);
+    if (rows != 0) {
+        char seq[32];
+        int n = snprintf(seq, sizeof(seq), "\x1b[%ld%c", rows < 0 ? -rows : rows, rows < 0 ? 'A' : 'B');
+        out_append(o, seq, n);
+    }
+    out_move(o, (long)(to % width) - (long)(from % width));
+}
+
+// line editor state for one prompt
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+    size_t pos;                 // cursor byte offset
+    const char *prompt;
+    size_t prompt_width;
+    size_t cols;                // terminal width the line wraps at
+    char *shown;                // bytes currently on screen after the prompt
+    size_t shown_size;
+    size_t shown_len;
+    size_t shown_col;           // terminal cursor column relative to the prompt, counting across rows
+    int hist_index;             // hist_count while editing a fresh line
+    char *saved;                // fresh line stashed while walking history
+    OutBuf out;
+} LineEditor;
+
+// grows a heap buffer to hold at least need bytes; false if out of memory
+static bool grow_buffer(char **buf, size_t *size, size_t need) {
+    if (need <= *size) {
+        return true;
+    }
+    size_t size_new = *size ? *size : 256;
+    while (size_new < need) {
+        size_new *= 2;
+    }
+    char *grown = realloc(*buf, size_new);
+    if (grown == NULL) {
+        return false;
+    }
+    *buf = grown;
+    *size = size_new;
+    return true;
+}
+
+static size_t terminal_cols() {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0) {
+        return 80;
+    }
+    return ws.ws_col;
+}
+
+// redraws only what changed since the last refresh; a line longer than the
+// terminal is wide takes several rows, all redrawn from the first change on
+static void editor_refresh(LineEditor *ed) {
+    size_t p = ed->prompt_width;
+    size_t cols = ed->cols;
+    size_t d = 0;
+    while (d < ed->len && d < ed->shown_len && ed->buf[d] == ed->shown[d]) {
+        d++;
+    }
+    while (d > 0 && (utf8_cont(ed->buf[d]) || (d < ed->shown_len && utf8_cont(ed->shown[d])))) {
+        d--;
+    }
+
+    if (d < ed->len || d < ed->shown_len) {
+        size_t col_d = text_width(ed->buf, d);
+        size_t old_end = text_width(ed->shown, ed->shown_len);
+        out_goto(&ed->out, p + ed->shown_col, p + col_d, cols);
+        out_append(&ed->out, ed->buf + d, ed->len - d);
+        ed->shown_col = text_width(ed->buf, ed->len);
+        if (ed->len > d && (p + ed->shown_col) % cols == 0) {
+            out_append(&ed->out, "\r\n", 2);  // out of the last column's pending wrap
+        }
+        if (old_end > ed->shown_col) {
+            out_append(&ed->out, "\x1b[J", 3);  // the rest of this row and the rows below
+        }
+        if (grow_buffer(&ed->shown, &ed->shown_size, ed->len)) {
+            memcpy(ed->shown, ed->buf, ed->len);
+            ed->shown_len = ed->len;
         } else {
-            args[i++] = token;
+            ed->shown_len = 0;  // forces a full redraw next time
         }
-        token = strtok(NULL, " ");
     }
-    args[i] = NULL;
 
-    sub_var(args);
+    size_t cursor_col = text_width(ed->buf, ed->pos);
+    out_goto(&ed->out, p + ed->shown_col, p + cursor_col, cols);
+    ed->shown_col = cursor_col;
+    out_flush(&ed->out);
+}
 
-    if (args[0] == NULL) {
-        return;  
+// forget what is on screen and paint prompt and line from scratch, on the
+// row the cursor is on
+static void editor_repaint(LineEditor *ed) {
+    ed->shown_len = 0;
+    ed->shown_col = 0;
+    ed->cols = terminal_cols();
+    ed->prompt_width = text_width(ed->prompt, strlen(ed->prompt));
+    out_append(&ed->out, "\r", 1);
+    out_append(&ed->out, ed->prompt, strlen(ed->prompt));
+    out_append(&ed->out, "\x1b[J", 3);
+    if (ed->prompt_width > 0 && ed->prompt_width % ed->cols == 0) {
+        out_append(&ed->out, "\r\n", 2);
+    }
+    editor_refresh(ed);
+}
+
+static void editor_insert(LineEditor *ed, const char *s, size_t n) {
+    if (!grow_buffer(&ed->buf, &ed->size, ed->len + n + 1)) {
+        n = ed->size - ed->len - 1;
+        while (n > 0 && utf8_cont(s[n])) {
+            n--;
+        }
+    }
+    memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + ed->pos, s, n);
+    ed->pos += n;
+    ed->len += n;
+    ed->buf[ed->len] = '\0';
+}
+
+static void editor_delete(LineEditor *ed, size_t from, size_t to) {
+    memmove(ed->buf + from, ed->buf + to, ed->len - to);
+    ed->len -= to - from;
+    ed->buf[ed->len] = '\0';
+    if (ed->pos > to) {
+        ed->pos -= to - from;
+    } else if (ed->pos > from) {
+        ed->pos = from;
+    }
+}
+
+static void editor_set(LineEditor *ed, const char *s) {
+    ed->len = 0;
+    ed->pos = 0;
+    ed->buf[0] = '\0';
+    editor_insert(ed, s, strlen(s));
+}
+
+static void editor_history(LineEditor *ed, int dir) {
+    int target = ed->hist_index + dir;
+    if (target < 0 || target > hist_count) {
+        return;
+    }
+    if (ed->hist_index == hist_count) {
+        free(ed->saved);
+        ed->saved = strdup(ed->buf);
+    }
+    ed->hist_index = target;
+    editor_set(ed, target == hist_count ? (ed->saved != NULL ? ed->saved : "") : history[target]);
+}
+
+static void show_completions(LineEditor *ed, Completion *c) {
+    out_goto(&ed->out, ed->prompt_width + ed->shown_col, ed->prompt_width + text_width(ed->buf, ed->len), ed->cols);
+    out_append(&ed->out, "\n", 1);
+    for (int i = 0; i < c->count; i++) {
+        out_append(&ed->out, c->items[i], strlen(c->items[i]));
+        out_append(&ed->out, i + 1 < c->count ? "  " : "\n", i + 1 < c->count ? 2 : 1);
+    }
+    editor_repaint(ed);
+}
+
+static void editor_complete(LineEditor *ed, bool last_was_tab) {
+    Completion c = {0};
+    bool is_name;
+    size_t start = complete_word(ed->buf, ed->pos, &c, &is_name);
+    completion_finish(&c);
+    size_t typed = ed->pos - start;
+
+    if (c.count == 1) {
+        const char *item = c.items[0];
+        bool add_space = is_name || item[strlen(item) - 1] != '/';
+        editor_insert(ed, item + typed, strlen(item) - typed);
+        if (add_space) {
+            editor_insert(ed, " ", 1);
+        }
+    } else if (c.count > 1) {
+        size_t common_len = strlen(c.common);
+        if (common_len > typed) {
+            editor_insert(ed, c.common + typed, common_len - typed);
+        } else if (last_was_tab) {
+            show_completions(ed, &c);
+        }
+    }
+    completion_free(&c);
+}
+
+// a bracketed paste is read in blocks so it costs a handful of syscalls; keys
+// are read one at a time, leaving anything typed ahead of the command that
+// is about to run in the terminal for that command
+static char in_buf[4096];
+static size_t in_len = 0;
+static size_t in_pos = 0;
+static bool in_paste = false;
+
+// lines after the first newline of a paste, replayed at the next prompts
+static char *paste_pending = NULL;
+
+static int next_byte() {
+    while (in_pos == in_len) {
+        ssize_t n = read(STDIN_FILENO, in_buf, in_paste ? sizeof(in_buf) : 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        in_len = n;
+        in_pos = 0;
+    }
+    return (unsigned char)in_buf[in_pos++];
+}
+
+// collects a bracketed paste up to ESC[201~; returns true if it held a newline
+static bool editor_paste(LineEditor *ed) {
+    static const char end_mark[] = "\x1b[201~";
+    size_t cap = 4096, n = 0, matched = 0;
+    char *text = malloc(cap);
+    if (text == NULL) {
+        return false;
+    }
+    int c;
+    in_paste = true;
+    while ((c = next_byte()) >= 0) {
+        if (n + 1 >= cap) {
+            char *grown = realloc(text, cap * 2);
+            if (grown == NULL) {
+                break;
+            }
+            text = grown;
+            cap *= 2;
+        }
+        text[n++] = c == '\r' ? '\n' : c;
+        matched = (char)c == end_mark[matched] ? matched + 1 : ((char)c == end_mark[0] ? 1 : 0);
+        if (matched == sizeof(end_mark) - 1) {
+            n -= matched;
+            break;
+        }
+    }
+    in_paste = false;
+    text[n] = '\0';
+
+    char *newline = strchr(text, '\n');
+    if (newline == NULL) {
+        editor_insert(ed, text, n);
+        free(text);
+        return false;
+    }
+    editor_insert(ed, text, newline - text);
+    if (newline[1] != '\0') {
+        char *rest = strdup(newline + 1);
+        if (paste_pending != NULL) {
+            size_t a = strlen(rest), b = strlen(paste_pending);
+            char *joined = malloc(a + b + 1);
+            if (joined != NULL) {
+                memcpy(joined, rest, a);
+                memcpy(joined + a, paste_pending, b + 1);
+            }
+            free(rest);
+            free(paste_pending);
+            rest = joined;
+        }
+        paste_pending = rest;
+    }
+    free(text);
+    return true;
+}
+
+// reads one line from the terminal with editing, history and completion into
+// *line, growing it like getline(3); -1 on eof
+int read_interactive_line(const char *prompt, char **line, size_t *size) {
+    if (!isatty(STDIN_FILENO) || enable_raw_mode() != 0) {
+        printf("%s", prompt);
+        fflush(stdout);
+        if (getline(line, size, stdin) < 0) {
+            return -1;
+        }
+        (*line)[strcspn(*line, "\n")] = '\0';
+        return 0;
+    }
+
+    static LineEditor ed;
+    if (!grow_buffer(line, size, 1)) {
+        disable_raw_mode();
+        return -1;
+    }
+    ed.buf = *line;
+    ed.size = *size;
+    ed.prompt = prompt;
+    ed.hist_index = hist_count;
+    free(ed.saved);
+    ed.saved = NULL;
+    editor_set(&ed, "");
+    editor_repaint(&ed);
+
+    // continue a multi-line paste: complete lines run as if typed
+    if (paste_pending != NULL) {
+        char *rest = paste_pending;
+        paste_pending = NULL;
+        char *newline = strchr(rest, '\n');
+        if (newline != NULL) {
+            *newline = '\0';
+            if (newline[1] != '\0') {
+                paste_pending = strdup(newline + 1);
+            }
+        }
+        editor_insert(&ed, rest, strlen(rest));
+        editor_refresh(&ed);
+        free(rest);
+        if (newline != NULL) {
+            write_str("\n");
+            disable_raw_mode();
+            *line = ed.buf;
+            *size = ed.size;
+            return 0;
+        }
+    }
+
+    bool last_was_tab = false;
+    int result = 0;
+    while (1) {
+        int c = next_byte();
+        if (c < 0) {
+            result = -1;
+            break;
+        }
+        bool was_tab = last_was_tab;
+        last_was_tab = c == '\t';
+
+        if (c == '\r' || c == '\n') {
+            break;
+        } else if (c == '\t') {
+            editor_complete(&ed, was_tab);
+        } else if (c == 1) {            // ctrl-a
+            ed.pos = 0;
+        } else if (c == 5) {            // ctrl-e
+            ed.pos = ed.len;
+        } else if (c == 2) {            // ctrl-b
+            ed.pos = utf8_prev(ed.buf, ed.pos);
+        } else if (c == 6) {            // ctrl-f
+            ed.pos = utf8_next(ed.buf, ed.len, ed.pos);
+        } else if (c == 3) {            // ctrl-c drops the line
+            write_str("^C\n");
+            editor_set(&ed, "");
+            ed.hist_index = hist_count;
+            editor_repaint(&ed);
+            continue;
+        } else if (c == 4) {            // ctrl-d
+            if (ed.len == 0) {
+                result = -1;
+                break;
+            }
+            editor_delete(&ed, ed.pos, utf8_next(ed.buf, ed.len, ed.pos));
+        } else if (c == 127 || c == 8) {
+            editor_delete(&ed, utf8_prev(ed.buf, ed.pos), ed.pos);
+        } else if (c == 11) {           // ctrl-k
+            editor_delete(&ed, ed.pos, ed.len);
+        } else if (c == 21) {           // ctrl-u
+            editor_delete(&ed, 0, ed.pos);
+        } else if (c == 23) {           // ctrl-w
+            size_t from = ed.pos;
+            while (from > 0 && ed.buf[from - 1] == ' ') {
+                from--;
+            }
+            while (from > 0 && ed.buf[from - 1] != ' ') {
+                from--;
+            }
+            editor_delete(&ed, from, ed.pos);
+        } else if (c == 12) {           // ctrl-l
+            out_append(&ed.out, "\x1b[H\x1b[2J", 7);
+            editor_repaint(&ed);
+            continue;
+        } else if (c == 16) {           // ctrl-p
+            editor_history(&ed, -1);
+        } else if (c == 14) {           // ctrl-n
+            editor_history(&ed, 1);
+        } else if (c == 27) {
+            int c1 = next_byte();
+            if (c1 != '[' && c1 != 'O') {
+                continue;
+            }
+            int c2 = next_byte();
+            int num = 0;
+            while (c2 >= '0' && c2 <= '9') {
+                num = num * 10 + (c2 - '0');
+                c2 = next_byte();
+            }
+            if (c2 == 'A') {
+                editor_history(&ed, -1);
+            } else if (c2 == 'B') {
+                editor_history(&ed, 1);
+            } else if (c2 == 'C') {
+                ed.pos = utf8_next(ed.buf, ed.len, ed.pos);
+            } else if (c2 == 'D') {
+                ed.pos = utf8_prev(ed.buf, ed.pos);
+            } else if (c2 == 'H' || (c2 == '~' && (num == 1 || num == 7))) {
+                ed.pos = 0;
+            } else if (c2 == 'F' || (c2 == '~' && (num == 4 || num == 8))) {
+                ed.pos = ed.len;
+            } else if (c2 == '~' && num == 3) {
+                editor_delete(&ed, ed.pos, utf8_next(ed.buf, ed.len, ed.pos));
+            } else if (c2 == '~' && num == 200) {
+                if (editor_paste(&ed)) {
+                    editor_refresh(&ed);
+                    break;
+                }
+            }
+        } else if (c >= 32) {
+            // a multibyte character goes in whole, so the refresh never sees half of it
+            char ch[4] = { (char)c };
+            int n = 1;
+            int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+            for (int k = 0; k < extra; k++) {
+                int next = next_byte();
+                if (next < 0 || !utf8_cont(next)) {
+                    break;
+                }
+                ch[n++] = next;
+            }
+            editor_insert(&ed, ch, n);
+        }
+        editor_refresh(&ed);
+    }
+
+    ed.pos = ed.len;
+    editor_refresh(&ed);
+    write_str("\n");
+    disable_raw_mode();
+    *line = ed.buf;
+    *size = ed.size;
+    return result;
+}
+
+// infinte shell loop 
+void shell_loop() {
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+
+    while (1) {
+        background_reap();
+        if (interactive_mode) {
+            if (read_interactive_line(function_pending() ? "> " : "wsh> ", &line, &size) < 0) {
+                break;
+            }
+        } else {
+            if (getline(&line, &size, stdin) < 0) {
+                break;
+            }
+            line[strcspn(line, "\n")] = '\0';
+        }
+        lineno++;
+        char *trimmed_line = line;
+        while (*trimmed_line == ' ' || *trimmed_line == '\t') {
+            trimmed_line++;  
+        }
+        if (trimmed_line[0] == '#' || trimmed_line[0] == '\0') {
+            continue;  
+        }
+        if (function_collect(trimmed_line)) {
+            record_definition(trimmed_line);
+            continue;
+        }
+
+        if (strcmp(trimmed_line, "exit") == 0) {
+            break;
+        }
+
+        run_line(trimmed_line, "stdin", lineno);
+    }
+    free(line);
+}
+
+
+// child supervision: one epoll set watches a pidfd per running child, and a
+// single timerfd is armed for the earliest deadline kept in a min-heap
+
+struct SupervisedChild {
+    pid_t pid;
+    int pidfd;                  // -1 when pidfd_open is unavailable
+    long long deadline;         // monotonic ns, 0 for none
+    int signal;                 // sent at the deadline
+    long long kill_after;       // ns until SIGKILL after signal, 0 for none
+    bool signalled;
+    bool done;
+    int status;                 // waitpid status once done
+    int heap_index;             // -1 when not in the deadline heap
+};
+
+static int supervisor_epoll = -1;
+static int supervisor_timer = -1;
+static SupervisedChild **deadline_heap = NULL;
+static int deadline_count = 0;
+static int deadline_cap = 0;
+
+static long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void heap_swap(int a, int b) {
+    SupervisedChild *tmp = deadline_heap[a];
+    deadline_heap[a] = deadline_heap[b];
+    deadline_heap[b] = tmp;
+    deadline_heap[a]->heap_index = a;
+    deadline_heap[b]->heap_index = b;
+}
+
+static void heap_sift(int i) {
+    while (i > 0 && deadline_heap[(i - 1) / 2]->deadline > deadline_heap[i]->deadline) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int smallest = i;
+        int l = 2 * i + 1, r = 2 * i + 2;
+        if (l < deadline_count && deadline_heap[l]->deadline < deadline_heap[smallest]->deadline) {
+            smallest = l;
+        }
+        if (r < deadline_count && deadline_heap[r]->deadline < deadline_heap[smallest]->deadline) {
+            smallest = r;
+        }
+        if (smallest == i) {
+            return;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+// false when the heap cannot grow; c is then left without a deadline
+static bool heap_push(SupervisedChild *c) {
+    if (deadline_count == deadline_cap) {
+        int cap = deadline_cap ? deadline_cap * 2 : 16;
+        SupervisedChild **grown = realloc(deadline_heap, cap * sizeof(SupervisedChild *));
+        if (grown == NULL) {
+            return false;
+        }
+        deadline_heap = grown;
+        deadline_cap = cap;
+    }
+    c->heap_index = deadline_count;
+    deadline_heap[deadline_count++] = c;
+    heap_sift(c->heap_index);
+    return true;
+}
+
+static void heap_remove(SupervisedChild *c) {
+    int i = c->heap_index;
+    if (i < 0) {
+        return;
+    }
+    c->heap_index = -1;
+    deadline_count--;
+    if (i != deadline_count) {
+        deadline_heap[i] = deadline_heap[deadline_count];
+        deadline_heap[i]->heap_index = i;
+        heap_sift(i);
+    }
+}
+
+static void supervisor_arm_timer() {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (deadline_count > 0) {
+        long long when = deadline_heap[0]->deadline;
+        its.it_value.tv_sec = when / 1000000000LL;
+        its.it_value.tv_nsec = when % 1000000000LL;
+    }
+    timerfd_settime(supervisor_timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int supervisor_init() {
+    if (supervisor_epoll >= 0) {
+        return 0;
+    }
+    supervisor_epoll = epoll_create1(EPOLL_CLOEXEC);
+    supervisor_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (supervisor_epoll < 0 || supervisor_timer < 0) {
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    return epoll_ctl(supervisor_epoll, EPOLL_CTL_ADD, supervisor_timer, &ev);
+}
+
+// a forked shell must not share the parent's epoll set
+void supervisor_reset_after_fork() {
+    if (supervisor_epoll >= 0) {
+        close(supervisor_epoll);
+        close(supervisor_timer);
+    }
+    supervisor_epoll = -1;
+    supervisor_timer = -1;
+    deadline_count = 0;
+}
+
+// starts watching pid; timeout_ns > 0 sends sig at the deadline and SIGKILL kill_after_ns later.
+// NULL when out of memory: the child cannot be waited for, so it is killed and reaped
+SupervisedChild *supervise_add(pid_t pid, long long timeout_ns, int sig, long long kill_after_ns) {
+    SupervisedChild *c = calloc(1, sizeof(SupervisedChild));
+    if (c == NULL) {
+        fprintf(stderr, "wsh: supervise: %s\n", strerror(ENOMEM));
+        kill(pid, SIGKILL);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+        return NULL;
+    }
+    c->pid = pid;
+    c->pidfd = -1;
+    c->heap_index = -1;
+    c->signal = sig;
+    c->kill_after = kill_after_ns;
+
+    bool supervised = supervisor_init() == 0;
+    if (supervised) {
+        c->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    }
+    if (c->pidfd >= 0) {
+        fcntl(c->pidfd, F_SETFD, FD_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        epoll_ctl(supervisor_epoll, EPOLL_CTL_ADD, c->pidfd, &ev);
+    }
+    // a child without a pidfd keeps its deadline; supervise_wait polls it instead
+    if (timeout_ns > 0) {
+        c->deadline = monotonic_ns() + timeout_ns;
+        if (!heap_push(c)) {
+            fprintf(stderr, "wsh: supervise: %s; running %d without its timeout\n", strerror(ENOMEM), (int)pid);
+        } else if (supervised) {
+            supervisor_arm_timer();
+        }
+    }
+    return c;
+}
+
+static void supervise_signal(SupervisedChild *c, int sig) {
+    if (syscall(SYS_pidfd_send_signal, c->pidfd, sig, NULL, 0) != 0) {
+        kill(c->pid, sig);
+    }
+}
+
+static void supervise_deadlines() {
+    uint64_t expirations;
+    if (read(supervisor_timer, &expirations, sizeof(expirations)) < 0) {
+        // spurious wakeup, the heap is checked anyway
+    }
+    long long now = monotonic_ns();
+    while (deadline_count > 0 && deadline_heap[0]->deadline <= now) {
+        SupervisedChild *c = deadline_heap[0];
+        heap_remove(c);
+        if (!c->signalled) {
+            c->signalled = true;
+            supervise_signal(c, c->signal);
+            if (c->kill_after > 0 && c->signal != SIGKILL) {
+                c->deadline = now + c->kill_after;
+                heap_push(c);  // c just left the heap, so there is room
+            }
+        } else {
+            supervise_signal(c, SIGKILL);
+        }
+    }
+    supervisor_arm_timer();
+}
+
+static void supervise_reap(SupervisedChild *c) {
+    if (waitpid(c->pid, &c->status, WNOHANG) <= 0) {
+        return;
+    }
+    c->done = true;
+    if (c->pidfd >= 0) {
+        epoll_ctl(supervisor_epoll, EPOLL_CTL_DEL, c->pidfd, NULL);
+        close(c->pidfd);
+        c->pidfd = -1;
+    }
+    if (c->heap_index >= 0) {
+        heap_remove(c);
+        supervisor_arm_timer();
+    }
+}
+
+// one round of the event loop: deadlines that came due and children that
+// exited; false when epoll itself fails
+static bool supervise_events(int timeout_ms) {
+    struct epoll_event events[64];
+    int n = epoll_wait(supervisor_epoll, events, 64, timeout_ms);
+    if (n < 0) {
+        return errno == EINTR;
+    }
+    for (int i = 0; i < n; i++) {
+        SupervisedChild *ready = events[i].data.ptr;
+        if (ready == NULL) {
+            supervise_deadlines();
+        } else if (!ready->done) {
+            supervise_reap(ready);
+        }
+    }
+    return true;
+}
+
+// without a pidfd nothing wakes us when c exits: poll it with WNOHANG, backing
+// off to 10ms, and serve the deadlines (its own included) between polls
+static void supervise_poll(SupervisedChild *c) {
+    int delay_ms = 1;
+    while (true) {
+        pid_t r = waitpid(c->pid, &c->status, WNOHANG);
+        if (r == c->pid || (r < 0 && errno != EINTR)) {
+            break;
+        }
+        if (supervisor_epoll < 0 || !supervise_events(delay_ms)) {
+            struct timespec ts = { 0, delay_ms * 1000000L };
+            nanosleep(&ts, NULL);
+            if (deadline_count > 0 && deadline_heap[0]->deadline <= monotonic_ns()) {
+                supervise_deadlines();
+            }
+        }
+        delay_ms = delay_ms < 10 ? delay_ms * 2 : 10;
+    }
+    c->done = true;
+    if (c->heap_index >= 0) {
+        heap_remove(c);
+        supervisor_arm_timer();
+    }
+}
+
+// non-blocking: reaps c if it has exited, with or without a pidfd
+bool supervise_done(SupervisedChild *c) {
+    if (!c->done) {
+        supervise_reap(c);
+    }
+    return c->done;
+}
+
+// runs the event loop until c exits, serving every other child's deadlines meanwhile
+int supervise_wait(SupervisedChild *c, bool *timed_out) {
+    if (c->pidfd < 0) {
+        supervise_poll(c);
+    }
+    while (!c->done && supervise_events(-1)) {
+        // every round may reap c
+    }
+
+    int status = c->status;
+    if (timed_out != NULL) {
+        *timed_out = c->signalled;
+    }
+    free(c);
+    return status;
+}
+
+// parses a duration like 1.5, 10s, 2m, 1h or 1d into seconds
+static bool parse_duration(const char *arg, double *seconds) {
+    char *endptr;
+    double value = strtod(arg, &endptr);
+    double scale = 1;
+    if (*endptr == 'm') {
+        scale = 60;
+    } else if (*endptr == 'h') {
+        scale = 3600;
+    } else if (*endptr == 'd') {
+        scale = 86400;
+    } else if (*endptr != 's' && *endptr != '\0') {
+        return false;
+    }
+    if (endptr == arg || (*endptr != '\0' && endptr[1] != '\0') || value < 0) {
+        return false;
+    }
+    *seconds = value * scale;
+    return true;
+}
+
+static int parse_signal(const char *name) {
+    static const struct {
+        const char *name;
+        int sig;
+    } signals[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+        { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { NULL, 0 },
+    };
+    char *endptr;
+    long n = strtol(name, &endptr, 10);
+    if (*name != '\0' && *endptr == '\0') {
+        return n > 0 && n < NSIG ? n : -1;
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (int i = 0; signals[i].name != NULL; i++) {
+        if (strcmp(signals[i].name, name) == 0) {
+            return signals[i].sig;
+        }
+    }
+    return -1;
+}
+
+// shell metrics: counters bumped on the hot paths and read by the stats
+// builtin and the --metrics-file writer thread, so they are relaxed atomics
+
+#define SPAWN_BUCKETS 12
+
+static const double spawn_bounds[SPAWN_BUCKETS] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 1, 5, 30,
+};
+
+static struct {
+    atomic_long forks;
+    atomic_long threads;
+    atomic_long redirections;       // files opened by redirections
+    atomic_long builtin_calls[MAX_BUILTINS];
+    _Atomic(const char *) builtin_names[MAX_BUILTINS];  // set once per slot, so the writer never reads builtin_table
+    atomic_long history_entries;    // gauges, sampled after each command
+    atomic_long variables;
+    atomic_long functions;
+    atomic_long spawn_buckets[SPAWN_BUCKETS + 1];   // last one is +Inf
+    atomic_llong spawn_ns_sum;
+    atomic_llong spawn_ns_max;
+} metrics;
+
+// PATH is searched in the forked child, as execvp would, so the exec counters
+// live in a page the children share with the shell
+typedef struct {
+    atomic_long execs;              // resolved commands handed to execv
+    atomic_long exec_failures;      // found but execv failed, exit 126
+    atomic_long not_found;          // exit 127 from the PATH lookup
+    atomic_long path_probes;        // access() calls while searching PATH
+} ExecCounters;
+
+static ExecCounters exec_counters_private;
+static ExecCounters *exec_counters = &exec_counters_private;
+
+static char *metrics_path = NULL;
+static double metrics_interval = 10;
+static pthread_mutex_t metrics_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define METRIC_ADD(counter, n) atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#define METRIC_GET(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+#define METRIC_SET(counter, v) atomic_store_explicit(&(counter), (v), memory_order_relaxed)
+
+// before anything forks; without the shared page children's counts are lost
+void metrics_init() {
+    void *page = mmap(NULL, sizeof(ExecCounters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (page != MAP_FAILED) {
+        exec_counters = page;
+    }
+}
+
+// index is the builtin's builtin_table slot, which never changes hands
+void metrics_name_builtin(int index, const char *name) {
+    atomic_store_explicit(&metrics.builtin_names[index], name, memory_order_release);
+}
+
+static void metrics_count_redirects(RedirList *list) {
+    for (int i = 0; i < list->count; i++) {
+        if (list->items[i].kind == REDIR_OPEN) {
+            METRIC_ADD(metrics.redirections, 1);
+        }
+    }
+}
+
+// fork to reap, including any time spent waiting on a timeout
+static void metrics_observe_spawn(long long ns) {
+    int b = 0;
+    while (b < SPAWN_BUCKETS && ns > spawn_bounds[b] * 1e9) {
+        b++;
+    }
+    METRIC_ADD(metrics.spawn_buckets[b], 1);
+    METRIC_ADD(metrics.spawn_ns_sum, ns);
+    long long max = METRIC_GET(metrics.spawn_ns_max);
+    while (ns > max && !atomic_compare_exchange_weak(&metrics.spawn_ns_max, &max, ns)) {
+    }
+}
+
+static void metrics_sample() {
+    METRIC_SET(metrics.history_entries, hist_count);
+    METRIC_SET(metrics.variables, var_count);
+}
+
+static void metric_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metric_line(FILE *out, const char *name, const char *type, const char *help, long value) {
+    metric_header(out, name, type, help);
+    fprintf(out, "%s %ld\n", name, value);
+}
+
+// Prometheus text exposition format
+static void metrics_render(FILE *out) {
+    metric_line(out, "wsh_forks_total", "counter", "Processes forked by the shell.", METRIC_GET(metrics.forks));
+    metric_line(out, "wsh_builtin_threads_total", "counter", "Builtins run on a pipeline thread instead of a fork.",
+                METRIC_GET(metrics.threads));
+    metric_line(out, "wsh_execs_total", "counter", "Resolved commands handed to execv.",
+                METRIC_GET(exec_counters->execs));
+    metric_line(out, "wsh_exec_failures_total", "counter", "Commands found but not executable (exit 126).",
+                METRIC_GET(exec_counters->exec_failures));
+    metric_line(out, "wsh_command_not_found_total", "counter", "Commands missing from PATH (exit 127).",
+                METRIC_GET(exec_counters->not_found));
+    metric_line(out, "wsh_path_probes_total", "counter", "Candidate paths checked while searching PATH.",
+                METRIC_GET(exec_counters->path_probes));
+    metric_line(out, "wsh_redirections_opened_total", "counter", "Files opened by redirections.",
+                METRIC_GET(metrics.redirections));
+
+    metric_header(out, "wsh_builtin_calls_total", "counter", "Builtin invocations by name.");
+    for (int i = 0; i < MAX_BUILTINS; i++) {
+        const char *name = atomic_load_explicit(&metrics.builtin_names[i], memory_order_acquire);
+        if (name != NULL) {
+            fprintf(out, "wsh_builtin_calls_total{builtin=\"%s\"} %ld\n", name, METRIC_GET(metrics.builtin_calls[i]));
+        }
+    }
+
+    metric_line(out, "wsh_history_entries", "gauge", "Commands held in history.", METRIC_GET(metrics.history_entries));
+    metric_line(out, "wsh_shell_variables", "gauge", "Shell variables set with local.", METRIC_GET(metrics.variables));
+    metric_line(out, "wsh_functions", "gauge", "Shell functions defined.", METRIC_GET(metrics.functions));
+
+    metric_header(out, "wsh_spawn_duration_seconds", "histogram", "Time from fork to reaping an external command.");
+    long cumulative = 0;
+    for (int b = 0; b <= SPAWN_BUCKETS; b++) {
+        cumulative += METRIC_GET(metrics.spawn_buckets[b]);
+        if (b < SPAWN_BUCKETS) {
+            fprintf(out, "wsh_spawn_duration_seconds_bucket{le=\"%g\"} %ld\n", spawn_bounds[b], cumulative);
+        } else {
+            fprintf(out, "wsh_spawn_duration_seconds_bucket{le=\"+Inf\"} %ld\n", cumulative);
+        }
+    }
+    fprintf(out, "wsh_spawn_duration_seconds_sum %.9f\n", METRIC_GET(metrics.spawn_ns_sum) / 1e9);
+    fprintf(out, "wsh_spawn_duration_seconds_count %ld\n", cumulative);
+}
+
+// write to a temp file and rename, so scrapers never see a partial file
+static void metrics_write() {
+    pthread_mutex_lock(&metrics_write_lock);
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", metrics_path, (int)getpid());
+    FILE *out = fopen(tmp, "w");
+    if (out != NULL) {
+        metrics_render(out);
+        if (fclose(out) != 0 || rename(tmp, metrics_path) != 0) {
+            unlink(tmp);
+        }
+    }
+    pthread_mutex_unlock(&metrics_write_lock);
+}
+
+static void *metrics_thread(void *arg) {
+    (void)arg;
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);  // signals stay with the shell thread
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)metrics_interval;
+    ts.tv_nsec = (long)((metrics_interval - ts.tv_sec) * 1e9);
+    for (;;) {
+        nanosleep(&ts, NULL);
+        metrics_write();
+    }
+    return NULL;
+}
+
+static void metrics_exit() {
+    metrics_sample();
+    metrics_write();
+}
+
+// --metrics-file: rewritten every interval seconds and once more at exit
+void metrics_start(const char *path, double interval) {
+    char cwd[PATH_MAX];
+    if (path[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL) {
+        // absolute, so a later cd doesn't move the file
+        size_t len = strlen(cwd) + strlen(path) + 2;
+        metrics_path = malloc(len);
+        snprintf(metrics_path, len, "%s/%s", cwd, path);
+    } else {
+        metrics_path = strdup(path);
+    }
+    metrics_interval = interval;
+    metrics_write();
+    atexit(metrics_exit);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, metrics_thread, NULL) == 0) {
+        pthread_detach(tid);
+    }
+}
+
+static void print_stat(const char *name, long value) {
+    fprintf(builtin_stdout(), "%-20s %ld\n", name, value);
+}
+
+// stats [-p]: counters as a table, or -p for the Prometheus text format
+int stats_builtin(char **args) {
+    metrics_sample();
+    if (args[1] != NULL && strcmp(args[1], "-p") == 0 && args[2] == NULL) {
+        metrics_render(builtin_stdout());
+        return 0;
+    }
+    if (args[1] != NULL) {
+        fprintf(stderr, "wsh: stats: usage: stats [-p]\n");
+        return 2;
+    }
+    print_stat("forks", METRIC_GET(metrics.forks));
+    print_stat("threads", METRIC_GET(metrics.threads));
+    print_stat("execs", METRIC_GET(exec_counters->execs));
+    print_stat("exec failures", METRIC_GET(exec_counters->exec_failures));
+    print_stat("not found", METRIC_GET(exec_counters->not_found));
+    print_stat("path probes", METRIC_GET(exec_counters->path_probes));
+    print_stat("redirections", METRIC_GET(metrics.redirections));
+    print_stat("history entries", METRIC_GET(metrics.history_entries));
+    print_stat("variables", METRIC_GET(metrics.variables));
+    print_stat("functions", METRIC_GET(metrics.functions));
+
+    long spawns = 0;
+    for (int b = 0; b <= SPAWN_BUCKETS; b++) {
+        spawns += METRIC_GET(metrics.spawn_buckets[b]);
+    }
+    print_stat("spawns", spawns);
+    if (spawns > 0) {
+        fprintf(builtin_stdout(), "%-20s %.3f ms\n", "spawn mean", METRIC_GET(metrics.spawn_ns_sum) / 1e6 / spawns);
+        fprintf(builtin_stdout(), "%-20s %.3f ms\n", "spawn max", METRIC_GET(metrics.spawn_ns_max) / 1e6);
+    }
+    for (int i = 0; i < MAX_BUILTINS; i++) {
+        const char *name = atomic_load_explicit(&metrics.builtin_names[i], memory_order_acquire);
+        long calls = METRIC_GET(metrics.builtin_calls[i]);
+        if (name != NULL && calls > 0) {
+            char label[40];
+            snprintf(label, sizeof(label), "builtin %s", name);
+            print_stat(label, calls);
+        }
+    }
+    return 0;
+}
+
+// batch profiler: per-line wall time, child cpu time and forks, written as
+// folded stacks for flamegraph.pl plus a summary table sorted by wall time
+
+typedef struct ProfileEntry {
+    char *key;
+    long calls;
+    long long wall_ns;          // inclusive for summary rows, self for stacks
+    long long child_cpu_ns;
+    long forks;
+    struct ProfileEntry *next;
+} ProfileEntry;
+
+typedef struct {
+    size_t stack_len;           // length of profile_stack before this frame
+    long long start_ns;
+    long long child_cpu_start;
+    long long children_ns;      // inclusive time of nested frames
+    long fork_start;
+    char *label;
+} ProfileFrame;
+
+#define PROFILE_BUCKETS 1024
+#define MAX_PROFILE_DEPTH 64
+
+static char *profile_path = NULL;
+static ProfileEntry *profile_stacks[PROFILE_BUCKETS];
+static ProfileEntry *profile_lines[PROFILE_BUCKETS];
+static ProfileFrame profile_frames[MAX_PROFILE_DEPTH];
+static int profile_depth = 0;
+static char profile_stack[MAX_PROFILE_DEPTH * 128];
+
+static long long child_cpu_ns() {
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+static ProfileEntry *profile_entry(ProfileEntry **table, const char *key) {
+    unsigned int h = 5381;
+    for (const char *p = key; *p != '\0'; p++) {
+        h = h * 33 + (unsigned char)*p;
+    }
+    h %= PROFILE_BUCKETS;
+    for (ProfileEntry *e = table[h]; e != NULL; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    ProfileEntry *e = calloc(1, sizeof(ProfileEntry));
+    e->key = strdup(key);
+    e->next = table[h];
+    table[h] = e;
+    return e;
+}
+
+bool profiling() {
+    return profile_path != NULL;
+}
+
+// opens a frame named "where cmd"; ';' would split the folded stack so it is swapped out
+void profile_begin(const char *where, const char *cmd) {
+    if (profile_depth >= MAX_PROFILE_DEPTH) {
+        profile_depth++;  // too deep to record, only keep count
+        return;
+    }
+    ProfileFrame *f = &profile_frames[profile_depth++];
+    char label[128];
+    snprintf(label, sizeof(label), "%s %s", where, cmd);
+    for (char *p = label; *p != '\0'; p++) {
+        if (*p == ';') {
+            *p = ',';
+        }
+    }
+    f->label = strdup(label);
+    f->stack_len = strlen(profile_stack);
+    snprintf(profile_stack + f->stack_len, sizeof(profile_stack) - f->stack_len, "%s%s",
+             f->stack_len ? ";" : "", label);
+    f->children_ns = 0;
+    f->fork_start = METRIC_GET(metrics.forks);
+    f->child_cpu_start = child_cpu_ns();
+    f->start_ns = monotonic_ns();
+}
+
+void profile_end() {
+    if (profile_depth > MAX_PROFILE_DEPTH) {
+        profile_depth--;
+        return;
+    }
+    ProfileFrame *f = &profile_frames[--profile_depth];
+    long long wall = monotonic_ns() - f->start_ns;
+    long long cpu = child_cpu_ns() - f->child_cpu_start;
+    long forks = METRIC_GET(metrics.forks) - f->fork_start;
+
+    ProfileEntry *stack = profile_entry(profile_stacks, profile_stack);
+    stack->calls++;
+    stack->wall_ns += wall - f->children_ns;
+
+    ProfileEntry *line = profile_entry(profile_lines, f->label);
+    line->calls++;
+    line->wall_ns += wall;
+    line->child_cpu_ns += cpu;
+    line->forks += forks;
+
+    if (profile_depth > 0) {
+        profile_frames[profile_depth - 1].children_ns += wall;
+    }
+    profile_stack[f->stack_len] = '\0';
+    free(f->label);
+}
+
+static int cmp_profile_wall(const void *a, const void *b) {
+    const ProfileEntry *x = *(const ProfileEntry **)a;
+    const ProfileEntry *y = *(const ProfileEntry **)b;
+    return (x->wall_ns < y->wall_ns) - (x->wall_ns > y->wall_ns);
+}
+
+// folded stacks go to the --profile file, the summary table next to it with .summary appended
+static void profile_write() {
+    FILE *folded = fopen(profile_path, "w");
+    if (folded == NULL) {
+        perror("wsh: profile");
+        return;
+    }
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        for (ProfileEntry *e = profile_stacks[i]; e != NULL; e = e->next) {
+            fprintf(folded, "%s %lld\n", e->key, e->wall_ns / 1000);
+        }
+    }
+    fclose(folded);
+
+    int count = 0;
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        for (ProfileEntry *e = profile_lines[i]; e != NULL; e = e->next) {
+            count++;
+        }
+    }
+    ProfileEntry **rows = malloc((count + 1) * sizeof(ProfileEntry *));
+    int n = 0;
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        for (ProfileEntry *e = profile_lines[i]; e != NULL; e = e->next) {
+            rows[n++] = e;
+        }
+    }
+    qsort(rows, n, sizeof(ProfileEntry *), cmp_profile_wall);
+
+    char summary_path[PATH_MAX];
+    snprintf(summary_path, sizeof(summary_path), "%s.summary", profile_path);
+    FILE *summary = fopen(summary_path, "w");
+    if (summary != NULL) {
+        fprintf(summary, "%8s %12s %12s %12s %6s  %s\n", "calls", "wall_ms", "avg_us", "child_cpu_ms", "forks", "line");
+        for (int i = 0; i < n; i++) {
+            ProfileEntry *e = rows[i];
+            fprintf(summary, "%8ld %12.3f %12.1f %12.3f %6ld  %s\n", e->calls, e->wall_ns / 1e6,
+                    e->wall_ns / 1e3 / e->calls, e->child_cpu_ns / 1e6, e->forks, e->key);
+        }
+        fclose(summary);
+    }
+    free(rows);
+}
+
+void profile_start(const char *path) {
+    profile_path = strdup(path);
+    atexit(profile_write);
+}
+
+// session recorder: --record FILE appends one JSON object per input line
+// with its start time, cwd, exit status and duration; replay.c plays it back
+
+static FILE *record_file = NULL;
+
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') {
+            fprintf(out, "\\%c", ch);
+        } else if (ch == '\n') {
+            fputs("\\n", out);
+        } else if (ch == '\t') {
+            fputs("\\t", out);
+        } else if (ch < 0x20) {
+            fprintf(out, "\\u%04x", ch);
+        } else {
+            fputc(ch, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// opens the trace and marks where this session started, so a replay can
+// start in the same directory
+void record_start(const char *path) {
+    record_file = fopen(path, "ae");
+    if (record_file == NULL) {
+        perror("wsh: record");
+        exit(EXIT_FAILURE);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char cwd[PATH_MAX];
+    fprintf(record_file, "{\"ts\":%lld.%06ld,\"cwd\":", (long long)now.tv_sec, now.tv_nsec / 1000);
+    json_string(record_file, getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "");
+    fputs(",\"start\":true}\n", record_file);
+    fflush(record_file);
+}
+
+// status < 0 marks a line swallowed by a function definition
+void record_line(const char *line, const struct timespec *start, const char *cwd, int status, long long duration_ns) {
+    fprintf(record_file, "{\"ts\":%lld.%06ld,\"cwd\":", (long long)start->tv_sec, start->tv_nsec / 1000);
+    json_string(record_file, cwd);
+    fputs(",\"cmd\":", record_file);
+    json_string(record_file, line);
+    if (status < 0) {
+        fputs(",\"def\":true}\n", record_file);
+    } else {
+        fprintf(record_file, ",\"status\":%d,\"duration_us\":%lld}\n", status, duration_ns / 1000);
+    }
+    fflush(record_file);  // a crashed session still leaves a usable trace
+}
+
+// a function definition line, recorded so a replay can define it too
+void record_definition(const char *line) {
+    if (record_file == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char cwd[PATH_MAX];
+    record_line(line, &now, getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "", -1, 0);
+}
+
+// runs one input line, wrapped in a profile frame when profiling and
+// logged when recording
+void run_line(char *line, const char *source, int lineno) {
+    struct timespec wall;
+    char cwd[PATH_MAX];
+    long long start = 0;
+    if (record_file != NULL) {
+        clock_gettime(CLOCK_REALTIME, &wall);
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            cwd[0] = '\0';
+        }
+        start = monotonic_ns();
+    }
+
+    if (profile_path == NULL) {
+        process_cmd(line, true);
+    } else {
+        char where[64];
+        snprintf(where, sizeof(where), "%s:%d", source, lineno);
+        profile_begin(where, line);
+        process_cmd(line, true);
+        profile_end();
+    }
+
+    if (record_file != NULL) {
+        record_line(line, &wall, cwd, last_exit_status, monotonic_ns() - start);
+    }
+}
+
+// read-ahead for the read builtin: a regular file is read in chunks and the
+// fd's offset put back to what read actually consumed before anything else can
+// look at it, i.e. before a fork, a redirection or exit. Pipes and terminals
+// are shared with other processes and are read a byte at a time.
+#define READ_AHEAD_FDS 10
+#define READ_AHEAD_MIN 4096
+#define READ_AHEAD_MAX (256 * 1024)
+
+typedef struct {
+    char *data;
+    size_t start, end;
+    size_t chunk;           // next refill size, doubling while the fd stays ours
+    bool active;
+} ReadAhead;
+
+static ReadAhead read_ahead[READ_AHEAD_FDS];
+static bool read_ahead_used;
+
+// gives every buffered fd back its logical offset and drops the buffers
+static void read_ahead_sync() {
+    if (!read_ahead_used) {
+        return;
+    }
+    for (int fd = 0; fd < READ_AHEAD_FDS; fd++) {
+        ReadAhead *ra = &read_ahead[fd];
+        if (ra->active) {
+            if (ra->end > ra->start) {
+                lseek(fd, -(off_t)(ra->end - ra->start), SEEK_CUR);
+            }
+            ra->active = false;
+            ra->start = ra->end = 0;
+            ra->chunk = READ_AHEAD_MIN;
+        }
+    }
+    read_ahead_used = false;
+}
+
+// buffer for fd when it is a regular file the shell can seek back on, else NULL
+static ReadAhead *read_ahead_for(int fd) {
+    if (fd < 0 || fd >= READ_AHEAD_FDS) {
+        return NULL;
+    }
+    ReadAhead *ra = &read_ahead[fd];
+    if (ra->active) {
+        return ra;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || lseek(fd, 0, SEEK_CUR) < 0) {
+        return NULL;
+    }
+    static bool registered = false;
+    if (!registered) {
+        atexit(read_ahead_sync);
+        registered = true;
+    }
+    if (ra->data == NULL) {
+        ra->data = malloc(READ_AHEAD_MAX);
+        if (ra->data == NULL) {
+            return NULL;  // read a byte at a time instead
+        }
+        ra->chunk = READ_AHEAD_MIN;
+    }
+    ra->active = true;
+    read_ahead_used = true;
+    return ra;
+}
+
+// next byte from fd, -1 at end of input or on error
+static int read_ahead_byte(int fd, ReadAhead *ra) {
+    if (ra == NULL) {
+        unsigned char c;
+        ssize_t n;
+        do {
+            n = read(fd, &c, 1);
+        } while (n < 0 && errno == EINTR);
+        return n == 1 ? c : -1;
+    }
+    if (ra->start == ra->end) {
+        ssize_t n;
+        do {
+            n = read(fd, ra->data, ra->chunk);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            return -1;
+        }
+        ra->start = 0;
+        ra->end = n;
+        if (ra->chunk < READ_AHEAD_MAX) {
+            ra->chunk *= 2;
+        }
+    }
+    return (unsigned char)ra->data[ra->start++];
+}
+
+
+// per-command arena: the word copy, argv and expansions of a command line are
+// carved from here and dropped together when process_cmd returns
+
+#define ARENA_CHUNK 65536
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *prev;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+static __thread ArenaChunk *arena_top = NULL;     // per thread, for builtins run on pipeline threads
+static __thread ArenaChunk *arena_spare = NULL;   // one default chunk kept between commands
+
+static void *arena_alloc(size_t n) {
+    n = (n + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    if (arena_top == NULL || arena_top->size - arena_top->used < n) {
+        size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        ArenaChunk *c = NULL;
+        if (size == ARENA_CHUNK && arena_spare != NULL) {
+            c = arena_spare;
+            arena_spare = NULL;
+        } else {
+            c = malloc(sizeof(ArenaChunk) + size);
+            if (c == NULL) {
+                fprintf(stderr, "wsh: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            c->size = size;
+        }
+        c->used = 0;
+        c->prev = arena_top;
+        arena_top = c;
+    }
+    void *p = arena_top->data + arena_top->used;
+    arena_top->used += n;
+    return p;
+}
+
+static char *arena_strdup(const char *s) {
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(len), s, len);
+}
+
+// doubles an arena array; the old copy is reclaimed with the rest of the command
+static void *arena_grow(void *old, size_t old_size, size_t new_size) {
+    void *p = arena_alloc(new_size);
+    memcpy(p, old, old_size);
+    return p;
+}
+
+static ArenaMark arena_mark() {
+    ArenaMark m = { arena_top, arena_top != NULL ? arena_top->used : 0 };
+    return m;
+}
+
+static void arena_release(ArenaMark m) {
+    while (arena_top != m.chunk) {
+        ArenaChunk *c = arena_top;
+        arena_top = c->prev;
+        if (c->size == ARENA_CHUNK && arena_spare == NULL) {
+            arena_spare = c;
+        } else {
+            free(c);
+        }
+    }
+    if (arena_top != NULL) {
+        arena_top->used = m.used;
+    }
+}
+
+// parses a redirection token like 2>, >>, &>, 3<>, 2>&1 or 1>&-; false if tok is a plain word
+static bool parse_redirect_op(const char *tok, Redirect *r, const char **rest) {
+    const char *p = tok;
+    int fd = -1;
+    bool both = false;
+
+    if (*p == '&' && p[1] == '>') {
+        both = true;
+        p++;
+    } else if (*p >= '0' && *p <= '9') {
+        fd = 0;
+        while (*p >= '0' && *p <= '9') {
+            fd = fd * 10 + (*p++ - '0');
+        }
+    }
+    if (*p != '<' && *p != '>') {
+        return false;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->kind = REDIR_OPEN;
+    if (both) {
+        r->fd = STDOUT_FILENO;
+        r->both = true;
+        r->flags = O_WRONLY | O_CREAT | O_TRUNC;
+        if (p[1] == '>') {
+            r->flags = O_WRONLY | O_CREAT | O_APPEND;
+            p++;
+        }
+        p++;
+    } else if (p[0] == '<' && p[1] == '>') {
+        r->fd = fd < 0 ? STDIN_FILENO : fd;
+        r->flags = O_RDWR | O_CREAT;
+        p += 2;
+    } else if (p[0] == '<' && p[1] == '&') {
+        r->fd = fd < 0 ? STDIN_FILENO : fd;
+        r->kind = REDIR_DUP;
+        p += 2;
+    } else if (p[0] == '<') {
+        r->fd = fd < 0 ? STDIN_FILENO : fd;
+        r->flags = O_RDONLY;
+        p++;
+    } else if (p[1] == '>') {
+        r->fd = fd < 0 ? STDOUT_FILENO : fd;
+        r->flags = O_WRONLY | O_CREAT | O_APPEND;
+        p += 2;
+    } else if (p[1] == '&') {
+        r->fd = fd < 0 ? STDOUT_FILENO : fd;
+        r->kind = REDIR_DUP;
+        p += 2;
+    } else {
+        r->fd = fd < 0 ? STDOUT_FILENO : fd;
+        r->flags = O_WRONLY | O_CREAT | O_TRUNC;
+        p += p[1] == '|' ? 2 : 1;
+    }
+    // a bare >z, >>z or <z gzips whatever the target is called; >zfile is still a file
+    if (r->kind == REDIR_OPEN && (r->flags & O_ACCMODE) != O_RDWR && p[0] == 'z' && p[1] == '\0') {
+        r->compress = 'g';
+        p++;
+    }
+    *rest = p;
+    return true;
+}
+
+// resolves the word after a redirection operator; false on a bad target
+static bool finish_redirect(Redirect *r, char *target) {
+    if (target[0] == '$') {
+        char *found = get_var_value(target + 1);
+        if (found != NULL) {
+            target = found;
+        }
+    }
+    if (r->kind == REDIR_DUP) {
+        if (strcmp(target, "-") == 0) {
+            r->kind = REDIR_CLOSE;
+            return true;
+        }
+        char *endptr;
+        long fd = strtol(target, &endptr, 10);
+        if (*target != '\0' && *endptr == '\0' && fd >= 0) {
+            r->dup_fd = fd;
+            return true;
+        }
+        // >&file means &>file
+        if (r->fd != STDOUT_FILENO) {
+            return false;
+        }
+        r->kind = REDIR_OPEN;
+        r->both = true;
+        r->flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    size_t len = strlen(target);
+    if (r->compress == 0 && (r->flags & O_ACCMODE) != O_RDWR) {
+        if (len > 3 && strcmp(target + len - 3, ".gz") == 0) {
+            r->compress = 'g';
+        } else if (len > 4 && strcmp(target + len - 4, ".zst") == 0) {
+            r->compress = 'z';
+        }
+    }
+    r->target = target;
+    return true;
+}
+
+// performs one redirection on the current process
+static int redirect_apply_one(Redirect *r) {
+    if (r->kind == REDIR_CLOSE) {
+        close(r->fd);
+        return 0;
+    }
+    if (r->kind == REDIR_DUP) {
+        if (r->dup_fd == r->fd) {
+            return fcntl(r->fd, F_GETFD) < 0 ? -1 : 0;
+        }
+        if (dup2(r->dup_fd, r->fd) < 0) {
+            return -1;
+        }
+        return r->both && dup2(r->fd, STDERR_FILENO) < 0 ? -1 : 0;
+    }
+
+    int fd = open(r->target, r->flags, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fd != r->fd) {
+        if (dup2(fd, r->fd) < 0) {
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+    if (r->both && dup2(r->fd, STDERR_FILENO) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void redirect_error(Redirect *r) {
+    if (interactive_mode) {
+        return;
+    }
+    if (r->kind == REDIR_OPEN) {
+        perror("open");
+    } else {
+        fprintf(stderr, "wsh: %d: %s\n", r->dup_fd, strerror(errno));
+    }
+}
+
+// child side: apply the list in order and never look back
+void apply_redirects(RedirList *list) {
+    for (int i = 0; i < list->count; i++) {
+        if (redirect_apply_one(&list->items[i]) != 0) {
+            redirect_error(&list->items[i]);
+            _exit(1);
+        }
+    }
+}
+
+// restores fds saved by apply_redirects_saved, newest first
+void restore_redirects(RedirList *list) {
+    if (list->saved_count > 0) {
+        read_ahead_sync();
+    }
+    for (int i = list->saved_count - 1; i >= 0; i--) {
+        if (list->saved[i].copy >= 0) {
+            dup2(list->saved[i].copy, list->saved[i].fd);
+            close(list->saved[i].copy);
+        } else {
+            close(list->saved[i].fd);
+        }
+    }
+    list->saved_count = 0;
+}
+
+// makes redirections applied by apply_redirects_saved permanent (bare exec)
+static void discard_saved_redirects(RedirList *list) {
+    for (int i = 0; i < list->saved_count; i++) {
+        if (list->saved[i].copy >= 0) {
+            close(list->saved[i].copy);
+        }
+    }
+    list->saved_count = 0;
+}
+
+static void save_fd(RedirList *list, int fd) {
+    for (int i = 0; i < list->saved_count; i++) {
+        if (list->saved[i].fd == fd) {
+            return;
+        }
+    }
+    if (list->saved_count == MAX_REDIRS * 2) {
+        return;
+    }
+    list->saved[list->saved_count].fd = fd;
+    list->saved[list->saved_count].copy = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    list->saved_count++;
+}
+
+// builtin side: keep copies of every fd touched so the shell can restore them
+int apply_redirects_saved(RedirList *list) {
+    if (list->count > 0) {
+        read_ahead_sync();
+    }
+    for (int i = 0; i < list->count; i++) {
+        Redirect *r = &list->items[i];
+        save_fd(list, r->fd);
+        if (r->both) {
+            save_fd(list, STDERR_FILENO);
+        }
+        if (redirect_apply_one(r) != 0) {
+            redirect_error(r);
+            restore_redirects(list);
+            return -1;
+        }
+    }
+    metrics_count_redirects(list);
+    return 0;
+}
+
+// splits the next space separated word off *cursor; words opened by <( >( or $( run to their matching ).
+// With ends non-NULL a ; outside them ends the word as well, and *ends tells whether one did
+static char *scan_word(char **cursor, bool *ends) {
+    if (ends != NULL) {
+        *ends = false;
+    }
+    char *p = *cursor;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == '\0') {
+        *cursor = p;
+        return NULL;
+    }
+
+    char *start = p;
+    int depth = 0;
+    while (*p != '\0' && (depth > 0 || (*p != ' ' && *p != '\t'))) {
+        if (*p == '(' && (depth > 0 || (p > start && strchr("<>$", p[-1]) != NULL))) {
+            depth++;
+        } else if (*p == ')' && depth > 0) {
+            depth--;
+        } else if (*p == ';' && depth == 0 && ends != NULL) {
+            *ends = true;
+            break;
+        }
+        p++;
+    }
+    if (*p != '\0') {
+        *p++ = '\0';
+    }
+    *cursor = p;
+    return start;
+}
+
+static char *next_word(char **cursor) {
+    return scan_word(cursor, NULL);
+}
+
+// a command's words as the parser sees them, in the arena
+static char **split_words(char *cmd) {
+    size_t cap = 16;
+    char **words = arena_alloc(cap * sizeof(char *));
+    int n = 0;
+    char *cursor = cmd;
+    for (char *w = next_word(&cursor); w != NULL; w = next_word(&cursor)) {
+        if ((size_t)n + 1 == cap) {
+            words = arena_grow(words, cap * sizeof(char *), cap * 2 * sizeof(char *));
+            cap *= 2;
+        }
+        words[n++] = w;
+    }
+    words[n] = NULL;
+    return words;
+}
+
+static bool is_procsub(const char *word) {
+    return (word[0] == '<' || word[0] == '>') && word[1] == '(';
+}
+
+// starts the producer (<(cmd)) or consumer (>(cmd)) of a process substitution
+// and returns its /dev/fd path, or NULL on error
+static char *procsub_start(ProcSubs *subs, char *word) {
+    size_t len = strlen(word);
+    if (len < 3 || word[len - 1] != ')') {
+        if (!interactive_mode) {
+            fprintf(stderr, "wsh: syntax error: unterminated %.2s\n", word);
+        }
+        return NULL;
+    }
+    if (subs->count == MAX_PROCSUBS) {
+        if (!interactive_mode) {
+            fprintf(stderr, "wsh: too many process substitutions\n");
+        }
+        return NULL;
+    }
+
+    bool reader = word[0] == '<';  // the main command reads from it
+    char *inner = arena_strdup(word + 2);
+    inner[len - 3] = '\0';
+
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        if (!interactive_mode) {
+            perror("pipe");
+        }
+        return NULL;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    read_ahead_sync();
+    METRIC_ADD(metrics.forks, 1);
+    pid_t pid = fork();
+    if (pid < 0) {
+        if (!interactive_mode) {
+            perror("Fork failed");
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return NULL;
+    }
+    if (pid == 0) {
+        supervisor_reset_after_fork();
+        // only the main command needs the other substitutions' ends
+        for (int i = 0; i < subs->count; i++) {
+            close(subs->fds[i]);
+        }
+        dup2(reader ? pipefd[1] : pipefd[0], reader ? STDOUT_FILENO : STDIN_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        process_cmd(inner, false);
+        fflush(NULL);
+        _exit(last_exit_status);
+    }
+
+    close(reader ? pipefd[1] : pipefd[0]);
+    int fd = reader ? pipefd[0] : pipefd[1];
+    subs->fds[subs->count] = fd;
+    subs->children[subs->count] = supervise_add(pid, 0, 0, 0);
+    snprintf(subs->paths[subs->count], sizeof(subs->paths[0]), "/dev/fd/%d", fd);
+    return subs->paths[subs->count++];
+}
+
+// swaps a .gz/.zst redirection for a pipe to a gzip or zstd helper process, so
+// the command writes (or reads) plain bytes and never waits on the codec;
+// the file itself is opened here so errors show up like any redirection
+static bool compress_start(ProcSubs *subs, Redirect *r) {
+    if (subs->count == MAX_PROCSUBS) {
+        if (!interactive_mode) {
+            fprintf(stderr, "wsh: too many compressed redirections\n");
+        }
+        return false;
+    }
+    bool reading = (r->flags & O_ACCMODE) == O_RDONLY;
+    int file = open(r->target, r->flags | O_CLOEXEC, 0644);
+    if (file < 0) {
+        if (!interactive_mode) {
+            perror("open");
+        }
+        return false;
+    }
+    METRIC_ADD(metrics.redirections, 1);
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        if (!interactive_mode) {
+            perror("pipe");
+        }
+        close(file);
+        return false;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, 1 << 20);  // room for bursts while the codec catches up
+
+    fflush(stdout);
+    fflush(stderr);
+    read_ahead_sync();
+    METRIC_ADD(metrics.forks, 1);
+    pid_t pid = fork();
+    if (pid < 0) {
+        if (!interactive_mode) {
+            perror("Fork failed");
+        }
+        close(file);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return false;
+    }
+    if (pid == 0) {
+        for (int i = 0; i < subs->count; i++) {
+            close(subs->fds[i]);
+        }
+        dup2(reading ? file : pipefd[0], STDIN_FILENO);
+        dup2(reading ? pipefd[1] : file, STDOUT_FILENO);
+        const char *codec = r->compress == 'z' ? "zstd" : "gzip";
+        char *argv[] = { (char *)codec, "-q", reading ? "-dc" : "-c", NULL };
+        execvp(codec, argv);
+        fprintf(stderr, "wsh: %s: command not found\n", codec);
+        _exit(127);
+    }
+
+    close(file);
+    close(reading ? pipefd[1] : pipefd[0]);
+    int fd = reading ? pipefd[0] : pipefd[1];
+    subs->fds[subs->count] = fd;
+    subs->children[subs->count] = supervise_add(pid, 0, 0, 0);
+    subs->paths[subs->count][0] = '\0';
+    subs->count++;
+
+    r->kind = REDIR_DUP;
+    r->dup_fd = fd;
+    return true;
+}
+
+// batch scripts append to the same few logs over and over; their fds stay open
+// here, keyed by device and inode, so each `cmd >> log` costs a stat instead of
+// an open and a close. A stat that no longer matches (file replaced, removed or
+// its mode changed) reopens the path, and cd closes everything.
+#define APPEND_CACHE_SIZE 8
+
+typedef struct {
+    int fd;                 // -1 when unused
+    dev_t dev;
+    ino_t ino;
+    mode_t mode;
+    int flags;
+    unsigned long last_used;
+} AppendFd;
+
+static AppendFd append_cache[APPEND_CACHE_SIZE];
+static unsigned long append_clock;
+static bool append_cache_ready;
+
+static void append_cache_flush() {
+    for (int i = 0; i < APPEND_CACHE_SIZE && append_cache_ready; i++) {
+        if (append_cache[i].fd >= 0) {
+            close(append_cache[i].fd);
+            append_cache[i].fd = -1;
+        }
+    }
+}
+
+// points an appending redirection at a cached fd; leaves it alone on any
+// error so the usual open reports it
+static void append_cache_use(Redirect *r) {
+    if (!append_cache_ready) {
+        for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+            append_cache[i].fd = -1;
+        }
+        atexit(append_cache_flush);
+        append_cache_ready = true;
+    }
+    struct stat st;
+    bool exists = stat(r->target, &st) == 0;
+    if (exists && !S_ISREG(st.st_mode)) {
+        return;  // fifos and devices keep their open-per-command behaviour
+    }
+
+    AppendFd *slot = &append_cache[0];
+    for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+        AppendFd *e = &append_cache[i];
+        if (e->fd >= 0 && exists && e->dev == st.st_dev && e->ino == st.st_ino && e->flags == r->flags) {
+            if (e->mode != st.st_mode) {
+                break;  // permissions changed, let open decide again
+            }
+            e->last_used = ++append_clock;
+            r->kind = REDIR_DUP;
+            r->dup_fd = e->fd;
+            return;
+        }
+        if (e->fd < 0 || (slot->fd >= 0 && e->last_used < slot->last_used)) {
+            slot = e;
+        }
+    }
+
+    int fd = open(r->target, r->flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    if (fd < 10) {
+        int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);  // out of the way of N> targets
+        close(fd);
+        if (high < 0) {
+            return;
+        }
+        fd = high;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return;
+    }
+    // the same file under another name, or an entry whose file was replaced
+    for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+        AppendFd *e = &append_cache[i];
+        if (e->fd >= 0 && e->dev == st.st_dev && e->ino == st.st_ino && e->flags == r->flags) {
+            slot = e;
+            break;
+        }
+    }
+    if (slot->fd >= 0) {
+        close(slot->fd);
+    }
+    *slot = (AppendFd){ fd, st.st_dev, st.st_ino, st.st_mode, r->flags, ++append_clock };
+    r->kind = REDIR_DUP;
+    r->dup_fd = fd;
+}
+
+// closes the shell's pipe ends so producers see EPIPE and consumers see EOF, then reaps them
+static void procsub_finish(ProcSubs *subs) {
+    for (int i = 0; i < subs->count; i++) {
+        close(subs->fds[i]);
+    }
+    for (int i = 0; i < subs->count; i++) {
+        if (subs->children[i] != NULL) {
+            supervise_wait(subs->children[i], NULL);
+        }
+    }
+    subs->count = 0;
+}
+
+static bool keep_redirects = false;     // set by a bare exec
+static bool tail_exec_armed = false;    // --exec-last, on the script's final line
+
+// turns a command's words into arena args, starting its process substitutions
+// and collecting its redirections; NULL on errors, which set last_exit_status
+// where they fail
+static char **parse_command(char **words, ProcSubs *subs, RedirList *redirs) {
+    int count = 0;
+    while (words[count] != NULL) {
+        count++;
+    }
+    char **args = arena_alloc((count + 1) * sizeof(char *));
+    int i = 0;
+    redirs->count = 0;
+    redirs->saved_count = 0;
+
+    char **word = words;
+    char *token = *word;
+    while (token != NULL) {
+        Redirect r;
+        const char *target;
+        if (is_procsub(token)) {
+            token = procsub_start(subs, token);
+            if (token == NULL) {
+                last_exit_status = 1;
+                return NULL;
+            }
+            args[i++] = token;
+        } else if (parse_redirect_op(token, &r, &target)) {
+            // target attached (2>err.txt) or in the next word
+            if (*target == '\0') {
+                target = *++word;
+                if (target != NULL && is_procsub(target)) {
+                    target = procsub_start(subs, (char *)target);
+                    if (target == NULL) {
+                        last_exit_status = 1;
+                        return NULL;
+                    }
+                }
+            }
+            if (target == NULL || *target == '\0') {
+                if (!interactive_mode) {
+                    fprintf(stderr, "wsh: syntax error near unexpected token `newline'\n");
+                }
+                return NULL;
+            }
+            if (!finish_redirect(&r, (char *)target)) {
+                if (!interactive_mode) {
+                    fprintf(stderr, "wsh: %s: ambiguous redirect\n", target);
+                }
+                return NULL;
+            }
+            if (redirs->count == MAX_REDIRS) {
+                if (!interactive_mode) {
+                    fprintf(stderr, "wsh: too many redirections\n");
+                }
+                return NULL;
+            }
+            if (r.compress != 0 && !compress_start(subs, &r)) {
+                last_exit_status = 1;
+                return NULL;
+            }
+            if (!interactive_mode && r.kind == REDIR_OPEN && (r.flags & O_APPEND)) {
+                append_cache_use(&r);
+            }
+            redirs->items[redirs->count++] = r;
+        } else {
+            args[i++] = token;
+        }
+        token = *++word;
+    }
+    args[i] = NULL;
+
+    args = sub_var(args);
+    if (args == NULL) {
+        last_exit_status = 1;
+    }
+    return args;
+}
+
+static void run_command(char **words, ProcSubs *subs) {
+    RedirList redirs;
+    char **args = parse_command(words, subs, &redirs);
+    if (args == NULL || args[0] == NULL) {
+        return;
+    }
+
+    // builtins and functions run here, so their redirections are undone afterwards
+    ShellFunction *fn = find_function(args[0]);
+    if (fn != NULL || find_builtin(args[0]) != NULL) {
+        tail_exec_armed = false;  // a function body goes on after its first command
+        fflush(stdout);
+        fflush(stderr);
+        if (apply_redirects_saved(&redirs) != 0) {
+            last_exit_status = 1;
+            return;
+        }
+        last_exit_status = fn != NULL ? call_function(fn, args) : process_builtin(args);
+        fflush(stdout);
+        fflush(stderr);
+        if (keep_redirects) {
+            keep_redirects = false;
+            discard_saved_redirects(&redirs);
+        } else {
+            restore_redirects(&redirs);
+        }
+        return;
+    }
+
+    // the script's last command may take over the process instead of being waited on
+    if (tail_exec_armed && subs->count == 0) {
+        tail_exec_armed = false;
+        last_exit_status = exec_command(args, &redirs);
+        return;
+    }
+
+    // external commands get their redirections in the child only
+    launch_external(args, NULL, &redirs);
+}
+
+// pipelines and background jobs. External commands and builtins that change
+// shell state run in forked children, as in any shell. In a foreground
+// pipeline, builtins that leave the shell alone run on a thread instead, with
+// a private fd table and cwd (unshare CLONE_FILES | CLONE_FS) and their own
+// stdout stream, so `vars | grep` costs a thread start rather than a fork.
+// Background jobs always fork: they must outlive the shell like a subshell.
+static bool fork_builtins = false;      // --fork-builtins
+
+typedef struct {
+    const Builtin *builtin;
+    char **args;                // in the command's arena, which outlives the thread
+    RedirList redirs;
+    int in_fd, out_fd, other_fd;    // other_fd is the read end of out_fd's pipe
+    int status;
+    bool unshared;
+    sem_t ready;
+    pthread_t thread;
+} BuiltinThread;
+
+typedef struct {
+    SupervisedChild *child;     // a forked stage,
+    BuiltinThread *thread;      // a foreground stage on a thread,
+    int status;                 // or one that never started
+    int job;
+} PipeStage;
+
+static PipeStage *background = NULL;
+static int background_count = 0;
+static int background_cap = 0;
+static int next_job = 1;
+
+// builtins that only read shell state may run on a thread while the shell
+// waits; a background thread would die with the shell, so those fork
+static bool builtin_threadable(const Builtin *b, char **args, bool in_background) {
+    if (fork_builtins || in_background || !b->threaded) {
+        return false;
+    }
+    return b->fn != process_history_builtin || args[1] == NULL;  // history N runs a command, history set N resizes
+}
+
+static void *builtin_thread_main(void *arg) {
+    BuiltinThread *t = arg;
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);  // SIGPIPE becomes EPIPE, the rest stay with the shell
+    t->unshared = unshare(CLONE_FILES | CLONE_FS) == 0;
+    if (t->unshared) {
+        if (t->in_fd >= 0) {
+            dup2(t->in_fd, STDIN_FILENO);
+            close(t->in_fd);
+        }
+        if (t->out_fd >= 0) {
+            dup2(t->out_fd, STDOUT_FILENO);
+            close(t->out_fd);
+        }
+        if (t->other_fd >= 0) {
+            close(t->other_fd);
+        }
+    }
+    sem_post(&t->ready);
+    if (!t->unshared) {
+        return NULL;
+    }
+
+    t->status = 1;
+    for (int i = 0; i < t->redirs.count; i++) {
+        if (redirect_apply_one(&t->redirs.items[i]) != 0) {
+            redirect_error(&t->redirs.items[i]);
+            return NULL;
+        }
+    }
+    builtin_out = fdopen(STDOUT_FILENO, "w");
+    if (builtin_out == NULL) {
+        fprintf(stderr, "wsh: %s: write error: %s\n", t->args[0], strerror(errno));
+        return NULL;
+    }
+    ArenaMark mark = arena_mark();
+    t->status = builtin_call(t->builtin, t->args);
+    fclose(builtin_out);
+    builtin_out = NULL;
+    arena_release(mark);
+    free(arena_spare);
+    arena_spare = NULL;
+    return NULL;
+}
+
+// starts b on a thread once it has its own fd table; NULL if the kernel
+// refuses one, and the caller forks instead
+static BuiltinThread *builtin_thread_start(const Builtin *b, char **args, RedirList *redirs, int in_fd, int out_fd,
+                                           int other_fd) {
+    BuiltinThread *t = malloc(sizeof(BuiltinThread));
+    t->builtin = b;
+    t->args = args;
+    t->redirs = *redirs;
+    t->in_fd = in_fd;
+    t->out_fd = out_fd;
+    t->other_fd = other_fd;
+    t->status = 0;
+    sem_init(&t->ready, 0, 0);
+
+    fflush(stdout);
+    if (pthread_create(&t->thread, NULL, builtin_thread_main, t) != 0) {
+        free(t);
+        return NULL;
+    }
+    while (sem_wait(&t->ready) != 0 && errno == EINTR) {
+        // retry
+    }
+    sem_destroy(&t->ready);
+    if (!t->unshared) {
+        pthread_join(t->thread, NULL);
+        free(t);
+        return NULL;
+    }
+    METRIC_ADD(metrics.threads, 1);
+    return t;
+}
+
+// forks a stage: external commands exec, builtins and functions run in the child
+static SupervisedChild *fork_stage(char **args, RedirList *redirs, int in_fd, int out_fd, int other_fd) {
+    fflush(stdout);
+    fflush(stderr);
+    read_ahead_sync();
+    METRIC_ADD(metrics.forks, 1);
+    pid_t pid = fork();
+    if (pid < 0) {
+        if (!interactive_mode) {
+            perror("Fork failed");
+        }
+        return NULL;
+    }
+    if (pid == 0) {
+        supervisor_reset_after_fork();
+        // the pipe fds are close-on-exec, their dup2 copies are not
+        if (in_fd >= 0) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd >= 0) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        if (other_fd >= 0) {
+            close(other_fd);  // a builtin writer must see EPIPE once the reader is gone
+        }
+        ShellFunction *fn = find_function(args[0]);
+        if (fn == NULL && find_builtin(args[0]) == NULL) {
+            _exit(exec_command(args, redirs));
+        }
+        apply_redirects(redirs);
+        int status = fn != NULL ? call_function(fn, args) : process_builtin(args);
+        fflush(NULL);
+        _exit(status);
+    }
+    return supervise_add(pid, 0, 0, 0);
+}
+
+static PipeStage start_stage(char **args, RedirList *redirs, int in_fd, int out_fd, int other_fd, bool in_background) {
+    PipeStage stage = { NULL, NULL, 0, 0 };
+    if (args[0] == NULL) {
+        return stage;  // redirections alone
+    }
+    const Builtin *b = find_function(args[0]) == NULL ? find_builtin(args[0]) : NULL;
+    if (b != NULL && builtin_threadable(b, args, in_background)) {
+        stage.thread = builtin_thread_start(b, args, redirs, in_fd, out_fd, other_fd);
+        if (stage.thread != NULL) {
+            return stage;
+        }
+    }
+    stage.child = fork_stage(args, redirs, in_fd, out_fd, other_fd);
+    stage.status = stage.child == NULL ? 127 : 0;
+    return stage;
+}
+
+static int stage_wait(PipeStage *stage) {
+    if (stage->thread != NULL) {
+        pthread_join(stage->thread->thread, NULL);
+        int status = stage->thread->status;
+        free(stage->thread);
+        stage->thread = NULL;
+        stage->status = status;
+    } else if (stage->child != NULL) {
+        int status = supervise_wait(stage->child, NULL);
+        stage->child = NULL;
+        stage->status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    }
+    return stage->status;
+}
+
+// collects background stages that have finished without blocking, so
+// neither zombies nor the list pile up between waits
+void background_reap() {
+    int kept = 0;
+    for (int i = 0; i < background_count; i++) {
+        PipeStage *stage = &background[i];
+        if (stage->child == NULL || supervise_done(stage->child)) {
+            stage_wait(stage);
+        } else {
+            background[kept++] = *stage;
+        }
+    }
+    background_count = kept;
+}
+
+// a | b | c, or any command line ending in &
+static void run_pipeline(char ***stages, int count, ProcSubs *subs, bool in_background) {
+    // every stage is expanded before any starts, so a $(( )) assignment cannot race a vars thread
+    char ***args = arena_alloc(count * sizeof(char **));
+    RedirList *redirs = arena_alloc(count * sizeof(RedirList));
+    for (int i = 0; i < count; i++) {
+        args[i] = parse_command(stages[i], subs, &redirs[i]);
+        if (args[i] == NULL) {
+            return;
+        }
+    }
+
+    PipeStage *running = arena_alloc(count * sizeof(PipeStage));
+    int in_fd = -1;
+    int started = 0;
+    for (; started < count; started++) {
+        int pipefd[2] = { -1, -1 };
+        if (started + 1 < count && pipe2(pipefd, O_CLOEXEC) != 0) {
+            if (!interactive_mode) {
+                perror("pipe");
+            }
+            break;
+        }
+        running[started] = start_stage(args[started], &redirs[started], in_fd, pipefd[1], pipefd[0], in_background);
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        if (pipefd[1] >= 0) {
+            close(pipefd[1]);
+        }
+        in_fd = pipefd[0];
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+
+    if (in_background && started == count) {
+        background_reap();
+        int job = next_job++;
+        for (int i = 0; i < count; i++) {
+            if (background_count == background_cap) {
+                background_cap = background_cap ? background_cap * 2 : 16;
+                background = realloc(background, background_cap * sizeof(PipeStage));
+            }
+            running[i].job = job;
+            background[background_count++] = running[i];
+        }
+        if (interactive_mode) {
+            PipeStage *last = &running[count - 1];
+            printf("[%d] %d\n", job, last->child != NULL ? last->child->pid : 0);
+        }
+        last_exit_status = 0;
+        return;
+    }
+    for (int i = 0; i < started; i++) {
+        stage_wait(&running[i]);
+    }
+    last_exit_status = started == count ? running[count - 1].status : 1;
+}
+
+// wait: blocks until every background job has finished
+static int wait_builtin(char **args) {
+    (void)args;
+    int status = 0;
+    for (int i = 0; i < background_count; i++) {
+        status = stage_wait(&background[i]);
+    }
+    background_count = 0;
+    return status;
+}
+
+// splits line on | outside parentheses into the stages of a pipeline
+static int split_pipeline(char *line, char ***stages) {
+    int cap = 4, count = 0;
+    char **out = arena_alloc(cap * sizeof(char *));
+    out[count++] = line;
+    int depth = 0;
+    for (char *p = line; *p != '\0'; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && depth > 0) {
+            depth--;
+        } else if (*p == '|' && depth == 0 && (p == line || p[-1] != '>')) {  // >| is a redirection
+            *p = '\0';
+            if (count == cap) {
+                out = arena_grow(out, cap * sizeof(char *), cap * 2 * sizeof(char *));
+                cap *= 2;
+            }
+            out[count++] = p + 1;
+        }
+    }
+    *stages = out;
+    return count;
+}
+
+// a word starting with # comments out the rest of the line
+static void strip_comment(char *line) {
+    int depth = 0;
+    for (char *p = line; *p != '\0'; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && depth > 0) {
+            depth--;
+        } else if (*p == '#' && depth == 0 && (p == line || p[-1] == ' ' || p[-1] == '\t')) {
+            *p = '\0';
+            return;
+        }
+    }
+}
+
+// strips a trailing & that is not part of >&, <& or &&
+static bool strip_background(char *line) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) {
+        len--;
+    }
+    if (len == 0 || line[len - 1] != '&' || (len >= 2 && strchr("<>&", line[len - 2]) != NULL)) {
+        return false;
+    }
+    line[len - 1] = '\0';
+    return true;
+}
+
+// a command line split into the words of each pipeline stage
+typedef struct {
+    char ***stages;             // NULL-terminated words of each stage
+    int count;
+    bool in_background;
+} ParsedLine;
+
+// splits a command line, in the arena, into the words of each pipeline stage
+static void parse_line(const char *cmd, ParsedLine *out) {
+    char *line = arena_strdup(cmd);
+    strip_comment(line);
+    out->in_background = strip_background(line);
+    char **stages;
+    out->count = split_pipeline(line, &stages);
+    out->stages = arena_alloc(out->count * sizeof(char **));
+    for (int i = 0; i < out->count; i++) {
+        out->stages[i] = split_words(stages[i]);
+    }
+}
+
+static void run_parsed(const ParsedLine *line) {
+    ArenaMark mark = arena_mark();
+    ProcSubs subs;
+    subs.count = 0;
+    bool empty_stage = false;
+    for (int i = 0; i < line->count; i++) {
+        empty_stage |= line->stages[i][0] == NULL;
+    }
+    if (line->count == 1 && !line->in_background) {
+        run_command(line->stages[0], &subs);
+    } else if (empty_stage) {
+        if (!interactive_mode) {
+            fprintf(stderr, "wsh: syntax error near unexpected token `%s'\n", line->count > 1 ? "|" : "&");
+        }
+        last_exit_status = 2;
+    } else {
+        run_pipeline(line->stages, line->count, &subs, line->in_background);
+    }
+    procsub_finish(&subs);
+    arena_release(mark);
+    metrics_sample();
+}
+
+void process_cmd(char *cmd, bool add_to_history) {
+    if (add_to_history) {
+        history_add(cmd);
+    }
+
+    ArenaMark mark = arena_mark();
+    ParsedLine line;
+    parse_line(cmd, &line);
+    run_parsed(&line);
+    arena_release(mark);
+}
+
+
+// scheduling attributes applied to launched commands
+LaunchAttrs launch_defaults = LAUNCH_ATTRS_INIT;
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+static const char *sched_policy_names[] = {
+    [SCHED_OTHER] = "other", [SCHED_FIFO] = "fifo", [SCHED_RR] = "rr",
+    [SCHED_BATCH] = "batch", [SCHED_IDLE] = "idle",
+};
+
+static const char *ioprio_class_names[] = { "none", "rt", "be", "idle" };
+
+// parses a cpu list like 0-3,6 into set
+static bool parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0') {
+        char *endptr;
+        long first = strtol(p, &endptr, 10);
+        long last = first;
+        if (endptr == p || first < 0) {
+            return false;
+        }
+        if (*endptr == '-') {
+            p = endptr + 1;
+            last = strtol(p, &endptr, 10);
+            if (endptr == p || last < first) {
+                return false;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*endptr == ',') {
+            endptr++;
+        } else if (*endptr != '\0') {
+            return false;
+        }
+        p = endptr;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+static void format_cpu_list(cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+        if (last == cpu) {
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu);
+        } else {
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        }
+        cpu = last;
+    }
+}
+
+// parses --cpus/--nice/--sched/--ionice starting at args[*i]; false on bad usage
+static bool parse_launch_option(char **args, int *i, LaunchAttrs *attrs, const char *who) {
+    char *opt = args[*i];
+    char *val = args[*i + 1];
+    if (val == NULL) {
+        fprintf(stderr, "wsh: %s: %s: missing argument\n", who, opt);
+        return false;
+    }
+
+    char *endptr;
+    if (strcmp(opt, "--cpus") == 0) {
+        if (!parse_cpu_list(val, &attrs->cpus)) {
+            fprintf(stderr, "wsh: %s: invalid cpu list %s\n", who, val);
+            return false;
+        }
+        attrs->has_cpus = true;
+    } else if (strcmp(opt, "--nice") == 0) {
+        long n = strtol(val, &endptr, 10);
+        if (*endptr != '\0' || n < -20 || n > 19) {
+            fprintf(stderr, "wsh: %s: invalid nice value %s\n", who, val);
+            return false;
+        }
+        attrs->has_nice = true;
+        attrs->nice = n;
+    } else if (strcmp(opt, "--sched") == 0) {
+        char name[16];
+        long prio = 0;
+        snprintf(name, sizeof(name), "%.*s", (int)strcspn(val, ":"), val);
+        char *colon = strchr(val, ':');
+        if (colon != NULL) {
+            prio = strtol(colon + 1, &endptr, 10);
+            if (*endptr != '\0') {
+                prio = -1;
+            }
+        }
+        int policy = -1;
+        for (size_t k = 0; k < sizeof(sched_policy_names) / sizeof(sched_policy_names[0]); k++) {
+            if (sched_policy_names[k] != NULL && strcmp(sched_policy_names[k], name) == 0) {
+                policy = k;
+            }
+        }
+        bool realtime = policy == SCHED_FIFO || policy == SCHED_RR;
+        if (policy < 0 || (realtime && (prio < 1 || prio > 99)) || (!realtime && prio != 0)) {
+            fprintf(stderr, "wsh: %s: invalid policy %s\n", who, val);
+            return false;
+        }
+        attrs->policy = policy;
+        attrs->priority = prio;
+    } else if (strcmp(opt, "--ionice") == 0) {
+        char name[16];
+        long level = 4;
+        snprintf(name, sizeof(name), "%.*s", (int)strcspn(val, ":"), val);
+        char *colon = strchr(val, ':');
+        if (colon != NULL) {
+            level = strtol(colon + 1, &endptr, 10);
+            if (*endptr != '\0') {
+                level = -1;
+            }
+        }
+        int io_class = -1;
+        for (int k = 1; k < 4; k++) {
+            if (strcmp(ioprio_class_names[k], name) == 0) {
+                io_class = k;
+            }
+        }
+        if (io_class < 0 || level < 0 || level > 7) {
+            fprintf(stderr, "wsh: %s: invalid io class %s\n", who, val);
+            return false;
+        }
+        attrs->io_class = io_class;
+        attrs->io_level = io_class == 3 ? 0 : level;
+    } else if (strcmp(opt, "--batch") == 0) {
+        long n = strtol(val, &endptr, 10);
+        if (*endptr != '\0' || n < 0) {
+            fprintf(stderr, "wsh: %s: invalid batch size %s\n", who, val);
+            return false;
+        }
+        attrs->batch = n;
+    } else {
+        fprintf(stderr, "wsh: %s: invalid option %s\n", who, opt);
+        return false;
+    }
+    (*i)++;
+    return true;
+}
+
+// runs in the forked child before exec; overrides win over shell defaults
+static void apply_launch_attrs(LaunchAttrs *overrides) {
+    LaunchAttrs attrs = launch_defaults;
+    if (overrides != NULL) {
+        if (overrides->has_cpus) {
+            attrs.has_cpus = true;
+            attrs.cpus = overrides->cpus;
+        }
+        if (overrides->has_nice) {
+            attrs.has_nice = true;
+            attrs.nice = overrides->nice;
+        }
+        if (overrides->policy >= 0) {
+            attrs.policy = overrides->policy;
+            attrs.priority = overrides->priority;
+        }
+        if (overrides->io_class >= 0) {
+            attrs.io_class = overrides->io_class;
+            attrs.io_level = overrides->io_level;
+        }
+    }
+
+    if (attrs.has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &attrs.cpus) != 0) {
+        perror("wsh: sched_setaffinity");
+        _exit(126);
+    }
+    if (attrs.policy >= 0) {
+        struct sched_param param = { .sched_priority = attrs.priority };
+        if (sched_setscheduler(0, attrs.policy, &param) != 0) {
+            perror("wsh: sched_setscheduler");
+            _exit(126);
+        }
+    }
+    if (attrs.has_nice && setpriority(PRIO_PROCESS, 0, attrs.nice) != 0) {
+        perror("wsh: setpriority");
+        _exit(126);
+    }
+    if (attrs.io_class >= 0) {
+        int prio = (attrs.io_class << IOPRIO_CLASS_SHIFT) | attrs.io_level;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio) != 0) {
+            perror("wsh: ioprio_set");
+            _exit(126);
+        }
+    }
+}
+
+// execv of args[0] as found in PATH, or as given when it has a /, in the
+// process that is about to become the command; returns only on failure, with
+// the status to exit with, after saying why when report is set
+static int exec_search(char **args, bool report) {
+    if (strchr(args[0], '/') != NULL) {
+        METRIC_ADD(exec_counters->execs, 1);
+        execv(args[0], args);
+    } else {
+        const char *dir = getenv("PATH");
+        errno = ENOENT;
+        while (dir != NULL && *dir != '\0') {
+            const char *end = strchrnul(dir, ':');
+            if (end > dir) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%.*s/%s", (int)(end - dir), dir, args[0]);
+                METRIC_ADD(exec_counters->path_probes, 1);
+                if (access(path, X_OK) == 0) {
+                    METRIC_ADD(exec_counters->execs, 1);
+                    execv(path, args);
+                    break;
+                }
+            }
+            dir = *end == ':' ? end + 1 : end;
+            errno = ENOENT;
+        }
+    }
+    if (errno == ENOENT) {
+        METRIC_ADD(exec_counters->not_found, 1);
+        if (report) {
+            fprintf(stderr, "wsh: command not found: %s\n", args[0]);
+        }
+        return 127;
+    }
+    METRIC_ADD(exec_counters->exec_failures, 1);
+    if (report) {
+        fprintf(stderr, "wsh: %s: %s\n", args[0], strerror(errno));
+    }
+    return 126;
+}
+
+// what execve copies for args plus the environment: strings and pointers
+static size_t exec_args_size(char **args) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t max_string = 32 * (size_t)(page > 0 ? page : 4096);  // MAX_ARG_STRLEN
+    size_t total = 0;
+    for (char **v = args; *v != NULL; v++) {
+        size_t n = strlen(*v) + 1;
+        if (n > max_string) {
+            return SIZE_MAX;
+        }
+        total += n + sizeof(char *);
+    }
+    for (char **v = environ; *v != NULL; v++) {
+        total += strlen(*v) + 1 + sizeof(char *);
+    }
+    return total + 2 * sizeof(char *);
+}
+
+// ARG_MAX less the 2048 bytes of headroom POSIX asks xargs to leave
+static size_t exec_args_limit() {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) {
+        arg_max = 131072;
+    }
+    return (size_t)arg_max - 2048;
+}
+
+static void args_too_long(const char *name, bool report) {
+    if (report) {
+        fprintf(stderr, "wsh: %s: argument list too long\n", name);
+    }
+    METRIC_ADD(exec_counters->exec_failures, 1);
+    last_exit_status = 126;
+}
+
+// xargs-style split of an oversized argv: the command and its first fixed
+// args start every run, the rest are packed up to the limit; redirections
+// are applied once around all runs, and the status is 123 if any run
+// failed, as with xargs
+static void launch_batched(char **args, LaunchAttrs *attrs, RedirList *redirs, int fixed) {
+    int argc = 0;
+    while (args[argc] != NULL) {
+        argc++;
+    }
+    if (fixed + 1 >= argc) {
+        args_too_long(args[0], !interactive_mode);  // nothing left to split
+        return;
+    }
+    char **run = arena_alloc((argc + 1) * sizeof(char *));
+    memcpy(run, args, (fixed + 1) * sizeof(char *));
+    run[fixed + 1] = NULL;
+    size_t base = exec_args_size(run);
+    size_t limit = exec_args_limit();
+    if (base >= limit) {
+        args_too_long(args[0], !interactive_mode);
+        return;
+    }
+
+    if (redirs != NULL) {
+        fflush(stdout);
+        if (apply_redirects_saved(redirs) != 0) {
+            last_exit_status = 1;
+            return;
+        }
+    }
+    bool failed = false;
+    int i = fixed + 1;
+    while (i < argc) {
+        int n = fixed + 1;
+        size_t used = base;
+        while (i < argc) {
+            size_t need = strlen(args[i]) + 1 + sizeof(char *);
+            if (n > fixed + 1 && used + need > limit) {
+                break;
+            }
+            run[n++] = args[i++];
+            used += need;
+        }
+        run[n] = NULL;
+        launch_external(run, attrs, NULL);
+        if (last_exit_status > 125) {
+            break;  // killed or not runnable: stop like xargs
+        }
+        failed |= last_exit_status != 0;
+    }
+    if (redirs != NULL) {
+        fflush(stdout);
+        restore_redirects(redirs);
+    }
+    if (last_exit_status <= 125 && failed) {
+        last_exit_status = 123;
+    }
+}
+
+// forks and execs an external command, last_exit_status gets its result
+void launch_external(char **args, LaunchAttrs *attrs, RedirList *redirs) {
+    if (exec_args_size(args) > exec_args_limit()) {
+        int fixed = attrs != NULL && attrs->batch >= 0 ? attrs->batch : launch_defaults.batch;
+        if (fixed < 0) {
+            args_too_long(args[0], !interactive_mode);
+        } else {
+            launch_batched(args, attrs, redirs, fixed);
+        }
+        return;
+    }
+    if (redirs != NULL) {
+        metrics_count_redirects(redirs);
+    }
+
+    read_ahead_sync();
+    fflush(stdout);  // keep builtin output ahead of the child's
+    METRIC_ADD(metrics.forks, 1);
+    long long spawn_start = monotonic_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        if (!interactive_mode) {
+            perror("Fork failed");
+        }
+        last_exit_status = 127;  
+        return;
+    }
+
+    if (pid == 0) {
+        if (redirs != NULL) {
+            apply_redirects(redirs);
+        }
+        apply_launch_attrs(attrs);
+        _exit(exec_search(args, !interactive_mode));
+    } else {
+        long long timeout_ns = 0, kill_after_ns = 0;
+        int sig = SIGTERM;
+        if (attrs != NULL && attrs->timeout > 0) {
+            timeout_ns = (long long)(attrs->timeout * 1e9);
+            kill_after_ns = (long long)(attrs->kill_after * 1e9);
+            sig = attrs->timeout_signal;
+        }
+        SupervisedChild *child = supervise_add(pid, timeout_ns, sig, kill_after_ns);
+        if (child == NULL) {
+            last_exit_status = 1;
+            return;
+        }
+        bool timed_out;
+        int status = supervise_wait(child, &timed_out);
+        metrics_observe_spawn(monotonic_ns() - spawn_start);
+
+        if (timed_out) {
+            // timeout(1) convention: 124, or 137 once SIGKILL was needed
+            last_exit_status = WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL && sig != SIGKILL ? 137 : 124;
+        } else if (WIFEXITED(status)) {
+            last_exit_status = WEXITSTATUS(status);
+        } else if (WIFSIGNALED(status)) {
+            last_exit_status = 128 + WTERMSIG(status);
+        }
+    }
+}
+
+// timeout [-s SIG] [-k KILLAFTER] DURATION cmd [args...]
+int timeout_builtin(char **args) {
+    LaunchAttrs attrs = LAUNCH_ATTRS_INIT;
+    attrs.timeout_signal = SIGTERM;
+    int i = 1;
+    while (args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL) {
+        if (strcmp(args[i], "-s") == 0) {
+            attrs.timeout_signal = parse_signal(args[i + 1]);
+            if (attrs.timeout_signal < 0) {
+                fprintf(stderr, "wsh: timeout: %s: invalid signal\n", args[i + 1]);
+                return 125;
+            }
+        } else if (strcmp(args[i], "-k") == 0) {
+            if (!parse_duration(args[i + 1], &attrs.kill_after)) {
+                fprintf(stderr, "wsh: timeout: invalid time interval '%s'\n", args[i + 1]);
+                return 125;
+            }
+        } else {
+            fprintf(stderr, "wsh: timeout: invalid option %s\n", args[i]);
+            return 125;
+        }
+        i += 2;
+    }
+    if (args[i] == NULL || args[i + 1] == NULL) {
+        fprintf(stderr, "wsh: timeout: missing operand\n");
+        return 125;
+    }
+    if (!parse_duration(args[i], &attrs.timeout)) {
+        fprintf(stderr, "wsh: timeout: invalid time interval '%s'\n", args[i]);
+        return 125;
+    }
+    launch_external(args + i + 1, &attrs, NULL);
+    return last_exit_status;
+}
+
+// run [--cpus LIST] [--nice N] [--sched POLICY[:PRIO]] [--ionice CLASS[:LEVEL]] [--batch N] cmd [args...]
+int run_builtin(char **args) {
+    LaunchAttrs attrs = LAUNCH_ATTRS_INIT;
+    int i = 1;
+    while (args[i] != NULL && strncmp(args[i], "--", 2) == 0) {
+        if (!parse_launch_option(args, &i, &attrs, "run")) {
+            return 1;
+        }
+        i++;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "wsh: run: missing command\n");
+        return 1;
+    }
+    launch_external(args + i, &attrs, NULL);
+    return last_exit_status;
+}
+
+// replaces the shell with args after applying redirs, without a fork; returns
+// the exit status to report only when that fails, with redirs undone
+int exec_command(char **args, RedirList *redirs) {
+    if (exec_args_size(args) > exec_args_limit()) {
+        args_too_long(args[0], true);  // the shell is not replaced, so always say why
+        return last_exit_status;
+    }
+    if (redirs != NULL && apply_redirects_saved(redirs) != 0) {
+        return 1;
+    }
+    read_ahead_sync();
+    fflush(NULL);
+    apply_launch_attrs(NULL);
+    int status = exec_search(args, true);
+    if (redirs != NULL) {
+        restore_redirects(redirs);
+    }
+    return status;
+}
+
+// exec [cmd [args...]]: cmd takes over the shell's process; a bare exec keeps
+// its redirections for the rest of the session
+static int exec_builtin(char **args) {
+    if (args[1] == NULL) {
+        keep_redirects = true;
+        return 0;
+    }
+    int status = exec_command(args + 1, NULL);
+    if (!interactive_mode) {
+        exit(status);  // a script whose exec failed does not carry on
+    }
+    return status;
+}
+
+// memo: a content-addressed store of command output. The key hashes argv, the
+// cwd, PATH, any --env variables and each --inputs file (stat identity, or its
+// bytes with --content). An entry is one file holding a small header with the
+// exit status followed by stdout, so a hit is an open, an fstat and a sendfile.
+// Misses tee stdout into a temp file; entries older than $WSH_MEMO_MAX_AGE
+// seconds go first, then the oldest until the store fits $WSH_MEMO_MAX_SIZE.
+// A running total in .usage means the store is only listed when it may have
+// outgrown the limit, or once an hour to expire old entries.
+#define MEMO_MAGIC "WSHMEMO1"
+#define MEMO_HEADER 16
+#define MEMO_DEFAULT_MAX_SIZE (256LL << 20)
+#define MEMO_DEFAULT_MAX_AGE (7 * 24 * 3600)
+#define MEMO_SCAN_INTERVAL 3600
+
+typedef struct {
+    uint64_t a, b;
+} MemoHash;
+
+static void memo_hash(MemoHash *h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h->a = (h->a ^ p[i]) * 0x100000001b3ULL;  // FNV-1a
+        h->b = (h->b + p[i] + 1) * 0x9e3779b97f4a7c15ULL;
+        h->b ^= h->b >> 29;
+    }
+}
+
+static void memo_hash_str(MemoHash *h, const char *s) {
+    memo_hash(h, s, strlen(s) + 1);
+}
+
+// folds one input file into the key; false if it cannot be read
+static bool memo_hash_input(MemoHash *h, const char *path, bool content) {
+    memo_hash_str(h, path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    if (!content) {
+        uint64_t id[5] = { st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+        memo_hash(h, id, sizeof(id));
+        close(fd);
+        return true;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        memo_hash(h, buf, n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+static long long memo_limit(const char *name, long long fallback) {
+    const char *value = getenv(name);
+    char *endptr;
+    long long n = value != NULL ? strtoll(value, &endptr, 10) : -1;
+    return n > 0 && *endptr == '\0' ? n : fallback;
+}
+
+// $WSH_MEMO_DIR, else ~/.cache/wsh-memo; created on first use
+static bool memo_dir(char *dir, size_t size) {
+    const char *env = getenv("WSH_MEMO_DIR");
+    if (env != NULL && *env != '\0') {
+        snprintf(dir, size, "%s", env);
+    } else {
+        const char *home = getenv("HOME");
+        snprintf(dir, size, "%s/.cache", home != NULL ? home : "/tmp");
+        mkdir(dir, 0755);
+        strncat(dir, "/wsh-memo", size - strlen(dir) - 1);
+    }
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "wsh: memo: %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// copies fd from offset to stdout, with sendfile where the kernel allows it
+static void memo_replay(int fd, off_t offset, off_t size) {
+    fflush(stdout);
+    while (offset < size) {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, &offset, size - offset);
+        if (n > 0) {
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            char buf[65536];
+            while ((n = pread(fd, buf, sizeof(buf), offset)) > 0) {
+                if (write(STDOUT_FILENO, buf, n) != n) {
+                    return;
+                }
+                offset += n;
+            }
+        }
+        return;
+    }
+}
+
+static bool write_all(int fd, const char *buf, ssize_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// forks a child copying a pipe to both stdout and fd; *out gets the write end
+static pid_t memo_tee(int fd, int *out) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    fflush(stdout);
+    read_ahead_sync();
+    METRIC_ADD(metrics.forks, 1);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(pipefd[1]);
+        char buf[65536];
+        bool stored = true, shown = true;  // a closed stdout still lets the entry fill
+        ssize_t n;
+        while ((n = read(pipefd[0], buf, sizeof(buf))) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                _exit(1);
+            }
+            shown = shown && write_all(STDOUT_FILENO, buf, n);
+            stored = stored && write_all(fd, buf, n);
+        }
+        _exit(stored ? 0 : 1);
+    }
+    close(pipefd[0]);
+    *out = pipefd[1];
+    return pid;
+}
+
+typedef struct {
+    long long bytes;   // store size as of the last scan, plus entries added since
+    long long scanned; // time of the last scan
+} MemoUsage;
+
+// adds bytes to the running total; true when the store needs a scan
+static bool memo_account(const char *dir, long long bytes, long long max_size) {
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/.usage", dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return true;
+    }
+    MemoUsage usage = { 0, 0 };
+    flock(fd, LOCK_EX);
+    bool known = pread(fd, &usage, sizeof(usage), 0) == sizeof(usage);
+    usage.bytes += bytes;
+    pwrite(fd, &usage, sizeof(usage), 0);
+    close(fd);
+    return !known || usage.bytes > max_size || time(NULL) - usage.scanned > MEMO_SCAN_INTERVAL;
+}
+
+static void memo_usage_reset(const char *dir, long long total) {
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/.usage", dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    MemoUsage usage = { total, time(NULL) };
+    flock(fd, LOCK_EX);
+    pwrite(fd, &usage, sizeof(usage), 0);
+    close(fd);
+}
+
+typedef struct {
+    char name[64];
+    off_t size;
+    time_t mtime;
+} MemoEntry;
+
+static int memo_entry_cmp(const void *a, const void *b) {
+    time_t x = ((const MemoEntry *)a)->mtime, y = ((const MemoEntry *)b)->mtime;
+    return (x > y) - (x < y);
+}
+
+// drops expired entries, then the oldest until the store fits
+static void memo_evict(const char *dir, long long max_size) {
+    long long max_age = memo_limit("WSH_MEMO_MAX_AGE", MEMO_DEFAULT_MAX_AGE);
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = dfd >= 0 ? fdopendir(dfd) : NULL;
+    if (d == NULL) {
+        if (dfd >= 0) {
+            close(dfd);
+        }
+        return;
+    }
+    size_t cap = 64, count = 0;
+    MemoEntry *entries = arena_alloc(cap * sizeof(MemoEntry));
+    long long total = 0;
+    time_t now = time(NULL);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(entries[0].name) ||
+            fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        bool temp = strstr(de->d_name, ".tmp.") != NULL;
+        if (now - st.st_mtime > (temp ? 3600 : max_age)) {
+            unlinkat(dfd, de->d_name, 0);  // expired, or a temp file left by a crash
+            continue;
+        }
+        if (temp) {
+            continue;
+        }
+        if (count == cap) {
+            entries = arena_grow(entries, cap * sizeof(MemoEntry), cap * 2 * sizeof(MemoEntry));
+            cap *= 2;
+        }
+        MemoEntry *e = &entries[count++];
+        strcpy(e->name, de->d_name);
+        e->size = st.st_size;
+        e->mtime = st.st_mtime;
+        total += st.st_size;
+    }
+    if (total > max_size) {
+        qsort(entries, count, sizeof(MemoEntry), memo_entry_cmp);
+        for (size_t i = 0; i < count && total > max_size; i++) {
+            if (unlinkat(dfd, entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    closedir(d);
+    memo_usage_reset(dir, total);
+}
+
+// memo [--inputs file... --] [--content] [--env NAME]... cmd [args...]
+static int memo_builtin(char **args) {
+    MemoHash h = { 0xcbf29ce484222325ULL, 0x243f6a8885a308d3ULL };
+    bool content = false;
+    int i = 1;
+    int inputs = 0;
+    for (; args[i] != NULL && strncmp(args[i], "--", 2) == 0; i++) {
+        if (strcmp(args[i], "--inputs") == 0) {
+            inputs = ++i;
+            while (args[i] != NULL && strcmp(args[i], "--") != 0) {
+                i++;
+            }
+            if (args[i] == NULL) {
+                fprintf(stderr, "wsh: memo: --inputs list must end with --\n");
+                return 2;
+            }
+        } else if (strcmp(args[i], "--content") == 0) {
+            content = true;
+        } else if (strcmp(args[i], "--env") == 0 && args[i + 1] != NULL) {
+            const char *value = getenv(args[++i]);
+            memo_hash_str(&h, args[i]);
+            memo_hash_str(&h, value != NULL ? value : "");
+        } else {
+            fprintf(stderr, "wsh: memo: invalid option %s\n", args[i]);
+            fprintf(stderr, "usage: memo [--inputs file... --] [--content] [--env NAME]... cmd [args...]\n");
+            return 2;
+        }
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "wsh: memo: missing command\n");
+        return 2;
+    }
+
+    char cwd[PATH_MAX];
+    const char *path_env = getenv("PATH");
+    memo_hash_str(&h, getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "");
+    memo_hash_str(&h, path_env != NULL ? path_env : "");
+    for (int k = inputs; inputs > 0 && strcmp(args[k], "--") != 0; k++) {
+        if (!memo_hash_input(&h, args[k], content)) {
+            fprintf(stderr, "wsh: memo: %s: %s\n", args[k], strerror(errno));
+            return 1;
+        }
+    }
+    for (int k = i; args[k] != NULL; k++) {
+        memo_hash_str(&h, args[k]);
+    }
+
+    char dir[PATH_MAX];
+    if (!memo_dir(dir, sizeof(dir))) {
+        return 1;
+    }
+    char entry[PATH_MAX + 64];
+    snprintf(entry, sizeof(entry), "%s/%016llx%016llx", dir, (unsigned long long)h.a, (unsigned long long)h.b);
+
+    int fd = open(entry, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        char header[MEMO_HEADER];
+        struct stat st;
+        if (fstat(fd, &st) == 0 && pread(fd, header, MEMO_HEADER, 0) == MEMO_HEADER &&
+            memcmp(header, MEMO_MAGIC, 8) == 0) {
+            int status;
+            memcpy(&status, header + 8, sizeof(status));
+            memo_replay(fd, MEMO_HEADER, st.st_size);
+            close(fd);
+            return status;
+        }
+        close(fd);  // not ours or torn; run the command and replace it
+    }
+
+    char temp[PATH_MAX + 96];
+    snprintf(temp, sizeof(temp), "%s.tmp.%d", entry, (int)getpid());
+    fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "wsh: memo: %s: %s\n", temp, strerror(errno));
+        return 1;
+    }
+    char header[MEMO_HEADER] = MEMO_MAGIC;
+    if (write(fd, header, MEMO_HEADER) != MEMO_HEADER) {
+        close(fd);
+        unlink(temp);
+        return 1;
+    }
+    int out;
+    pid_t tee = memo_tee(fd, &out);
+    if (tee < 0) {
+        fprintf(stderr, "wsh: memo: %s\n", strerror(errno));
+        close(fd);
+        unlink(temp);
+        return 1;
+    }
+    RedirList redirs;
+    redirs.count = 1;
+    redirs.saved_count = 0;
+    redirs.items[0] = (Redirect){ .fd = STDOUT_FILENO, .kind = REDIR_DUP, .dup_fd = out };
+    launch_external(args + i, NULL, &redirs);
+    int status = last_exit_status;
+    close(out);
+    int tee_status;
+    while (waitpid(tee, &tee_status, 0) < 0 && errno == EINTR) {
+    }
+    bool stored = WIFEXITED(tee_status) && WEXITSTATUS(tee_status) == 0;
+
+    struct stat st;
+    // not found, killed or timed out: nothing worth remembering
+    if (stored && status < 126 && fstat(fd, &st) == 0 &&
+        pwrite(fd, &status, sizeof(status), 8) == sizeof(status) && rename(temp, entry) == 0) {
+        long long max_size = memo_limit("WSH_MEMO_MAX_SIZE", MEMO_DEFAULT_MAX_SIZE);
+        if (memo_account(dir, st.st_size, max_size)) {
+            memo_evict(dir, max_size);
+        }
+    } else {
+        unlink(temp);
+    }
+    close(fd);
+    return status;
+}
+
+static void print_launch_attrs(const char *label, int policy, int priority, bool has_nice, int nice_value,
+                               cpu_set_t *cpus, int io_class, int io_level) {
+    FILE *out = builtin_stdout();
+    char cpu_list[256] = "any";
+    if (cpus != NULL) {
+        format_cpu_list(cpus, cpu_list, sizeof(cpu_list));
+    }
+    fprintf(out, "%s: policy=", label);
+    if (policy >= 0 && policy < (int)(sizeof(sched_policy_names) / sizeof(sched_policy_names[0])) &&
+        sched_policy_names[policy] != NULL) {
+        fprintf(out, "%s", sched_policy_names[policy]);
+    } else {
+        fprintf(out, "%s", policy < 0 ? "inherit" : "unknown");
+    }
+    if (priority > 0) {
+        fprintf(out, ":%d", priority);
+    }
+    if (has_nice) {
+        fprintf(out, " nice=%d", nice_value);
+    } else {
+        fprintf(out, " nice=inherit");
+    }
+    fprintf(out, " cpus=%s ionice=", cpu_list);
+    if (io_class >= 0 && io_class < 4) {
+        fprintf(out, "%s", ioprio_class_names[io_class]);
+        if (io_class == 1 || io_class == 2) {
+            fprintf(out, ":%d", io_level);
+        }
+    } else {
+        fprintf(out, "inherit");
+    }
+    fprintf(out, "\n");
+}
+
+// sched prints the shell's policy and launch defaults; sched [opts] or sched reset changes the defaults
+int sched_builtin(char **args) {
+    if (args[1] != NULL && strcmp(args[1], "reset") == 0) {
+        LaunchAttrs cleared = LAUNCH_ATTRS_INIT;
+        launch_defaults = cleared;
+        return 0;
+    }
+    if (args[1] != NULL) {
+        LaunchAttrs attrs = launch_defaults;
+        for (int i = 1; args[i] != NULL; i++) {
+            if (!parse_launch_option(args, &i, &attrs, "sched")) {
+                return 1;
+            }
+        }
+        launch_defaults = attrs;
+        return 0;
+    }
+
+    cpu_set_t cpus;
+    bool have_cpus = sched_getaffinity(0, sizeof(cpus), &cpus) == 0;
+    struct sched_param param = { 0 };
+    sched_getparam(0, &param);
+    errno = 0;
+    int nice_value = getpriority(PRIO_PROCESS, 0);
+    int ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    int io_class = ioprio < 0 ? -1 : ioprio >> IOPRIO_CLASS_SHIFT;
+    int io_level = ioprio < 0 ? 0 : ioprio & ((1 << IOPRIO_CLASS_SHIFT) - 1);
+
+    print_launch_attrs("shell", sched_getscheduler(0), param.sched_priority, errno == 0, nice_value,
+                       have_cpus ? &cpus : NULL, io_class, io_level);
+    print_launch_attrs("defaults", launch_defaults.policy, launch_defaults.priority, launch_defaults.has_nice,
+                       launch_defaults.nice, launch_defaults.has_cpus ? &launch_defaults.cpus : NULL,
+                       launch_defaults.io_class, launch_defaults.io_level);
+    if (launch_defaults.batch >= 0) {
+        fprintf(builtin_stdout(), "defaults: batch=%d\n", launch_defaults.batch);
+    }
+    return 0;
+}
+
+
+static int cd_builtin(char **args) {
+    if (args[1] != NULL && strcmp(args[1], "-j") == 0 && args[2] != NULL) {
+        return jump_builtin(args + 1);
+    }
+    if (args[1] == NULL || args[2] != NULL) {
+        if (!interactive_mode) {
+            fprintf(stderr, "wsh: cd: wrong number of arguments\n");
+        }
+        return 1;
+    }
+    cd(args[1]);
+    return 0;
+}
+
+static int pwd_builtin(char **args) {
+    (void)args;
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        fprintf(builtin_stdout(), "%s\n", cwd);
+    } else {
+        if (!interactive_mode) {
+            perror("wsh: pwd");
+        }
+    }
+    return 0;
+}
+
+static int export_builtin(char **args) {
+    handle_export(args[1]);
+    return 0;
+}
+
+static int local_builtin(char **args) {
+    return local(args[1]);
+}
+
+static int vars_builtin(char **args) {
+    (void)args;
+    show_vars();
+    return 0;
+}
+
+static int ls_builtin(char **args) {
+    if (args[1] != NULL && strcmp(args[1], "-R") == 0) {
+        WalkFilter filter = WALK_FILTER_INIT;
+        filter.skip_hidden = filter.bare_root = filter.sorted = true;
+        char *root = args[2] != NULL ? args[2] : ".";
+        return walk_paths(&root, 1, &filter, sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    ls();
+    return 0;
+}
+
+static int exit_builtin(char **args) {
+    (void)args;
+    handle_exit();
+    return 0;
+}
+
+static int true_builtin(char **args) {
+    (void)args;
+    return 0;
+}
+
+static int false_builtin(char **args) {
+    (void)args;
+    return 1;
+}
+
+// echo [-n] args, no escape processing like the POSIX/XSI-less default
+static int echo_builtin(char **args) {
+    FILE *out = builtin_stdout();
+    int i = 1;
+    bool newline = true;
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        newline = false;
+        i++;
+    }
+    for (; args[i] != NULL; i++) {
+        fputs(args[i], out);
+        if (args[i + 1] != NULL) {
+            putc(' ', out);
+        }
+    }
+    if (newline) {
+        putc('\n', out);
+    }
+    return 0;
+}
+
+// writes one backslash escape starting at s[0] == '\\', returns chars consumed; sets *stop on \c
+static int print_escape(const char *s, bool in_b, bool *stop) {
+    int used = 2;
+    int c;
+    switch (s[1]) {
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'v': c = '\v'; break;
+    case '\\': c = '\\'; break;
+    case 'c':
+        if (in_b) {
+            *stop = true;
+            return 2;
+        }
+        c = '\\';
+        used = 1;
+        break;
+    case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': {
+        // %b takes \0NNN, the format string takes \NNN
+        int start = (in_b && s[1] == '0') ? 2 : 1;
+        c = 0;
+        int k = start;
+        while (k < start + 3 && s[k] >= '0' && s[k] <= '7') {
+            c = c * 8 + (s[k] - '0');
+            k++;
+        }
+        used = k;
+        break;
+    }
+    case '\0':
+        c = '\\';
+        used = 1;
+        break;
+    default:
+        putc('\\', builtin_stdout());
+        c = s[1];
+        break;
+    }
+    putc(c, builtin_stdout());
+    return used;
+}
+
+static long long printf_integer(const char *arg, int *status) {
+    if (arg == NULL) {
+        return 0;
+    }
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char)arg[1];
+    }
+    char *endptr;
+    errno = 0;
+    long long value = strtoll(arg, &endptr, 0);
+    if (*arg == '\0' || *endptr != '\0' || errno != 0) {
+        fprintf(stderr, "wsh: printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+static double printf_float(const char *arg, int *status) {
+    if (arg == NULL) {
+        return 0;
+    }
+    char *endptr;
+    double value = strtod(arg, &endptr);
+    if (*arg == '\0' || *endptr != '\0') {
+        fprintf(stderr, "wsh: printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+// printf FORMAT [args], the format is reused until the arguments run out
+static int printf_builtin(char **args) {
+    FILE *out = builtin_stdout();
+    if (args[1] == NULL) {
+        fprintf(stderr, "wsh: printf: missing format\n");
+        return 2;
+    }
+    const char *format = args[1];
+    char **arg = args + 2;
+    int status = 0;
+    bool stop = false;
+
+    do {
+        bool consumed = false;
+        for (const char *p = format; *p != '\0' && !stop; p++) {
+            if (*p == '\\') {
+                p += print_escape(p, false, &stop) - 1;
+                continue;
+            }
+            if (*p != '%') {
+                putc(*p, out);
+                continue;
+            }
+            if (p[1] == '%') {
+                putc('%', out);
+                p++;
+                continue;
+            }
+
+            // copy flags, width and precision into a spec for the C printf
+            char spec[32];
+            size_t n = 0;
+            spec[n++] = '%';
+            p++;
+            while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL && n < sizeof(spec) - 4) {
+                spec[n++] = *p++;
+            }
+            char conv = *p;
+            if (conv == '\0') {
+                fprintf(stderr, "wsh: printf: missing conversion\n");
+                return 1;
+            }
+            const char *value = *arg;
+            if (*arg != NULL) {
+                arg++;
+                consumed = true;
+            }
+
+            switch (conv) {
+            case 'd':
+            case 'i':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = 'd';
+                spec[n] = '\0';
+                fprintf(out, spec, printf_integer(value, &status));
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conv;
+                spec[n] = '\0';
+                fprintf(out, spec, (unsigned long long)printf_integer(value, &status));
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                spec[n++] = conv;
+                spec[n] = '\0';
+                fprintf(out, spec, printf_float(value, &status));
+                break;
+            case 'c':
+                spec[n++] = 'c';
+                spec[n] = '\0';
+                fprintf(out, spec, value != NULL && value[0] != '\0' ? value[0] : '\0');
+                break;
+            case 's':
+                spec[n++] = 's';
+                spec[n] = '\0';
+                fprintf(out, spec, value != NULL ? value : "");
+                break;
+            case 'b':
+                for (const char *b = value != NULL ? value : ""; *b != '\0' && !stop; b++) {
+                    if (*b == '\\') {
+                        b += print_escape(b, true, &stop) - 1;
+                    } else {
+                        putc(*b, out);
+                    }
+                }
+                break;
+            default:
+                fprintf(stderr, "wsh: printf: %%%c: invalid conversion\n", conv);
+                return 1;
+            }
+        }
+        if (!consumed) {
+            break;
+        }
+    } while (*arg != NULL && !stop);
+
+    return status;
+}
+
+// test expression evaluator, recursive descent over argv
+typedef struct {
+    char **argv;
+    int pos;
+    int argc;
+    bool error;
+} TestParser;
+
+static bool test_expr(TestParser *t);
+
+static bool test_integer(TestParser *t, const char *s, long long *value) {
+    char *endptr;
+    errno = 0;
+    while (*s == ' ' || *s == '\t') {
+        s++;
+    }
+    *value = strtoll(s, &endptr, 10);
+    if (*s == '\0' || *endptr != '\0' || errno != 0) {
+        fprintf(stderr, "wsh: test: %s: integer expression expected\n", s);
+        t->error = true;
+        return false;
+    }
+    return true;
+}
+
+static bool test_unary(const char *op, const char *arg, bool *result) {
+    struct stat st;
+    if (strcmp(op, "-n") == 0) {
+        *result = arg[0] != '\0';
+    } else if (strcmp(op, "-z") == 0) {
+        *result = arg[0] == '\0';
+    } else if (strcmp(op, "-t") == 0) {
+        *result = isatty(atoi(arg));
+    } else if (strcmp(op, "-r") == 0) {
+        *result = access(arg, R_OK) == 0;
+    } else if (strcmp(op, "-w") == 0) {
+        *result = access(arg, W_OK) == 0;
+    } else if (strcmp(op, "-x") == 0) {
+        *result = access(arg, X_OK) == 0;
+    } else if (strcmp(op, "-h") == 0 || strcmp(op, "-L") == 0) {
+        *result = lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    } else if (strlen(op) == 2 && op[0] == '-' && strchr("edfsbcpSgu", op[1]) != NULL) {
+        if (stat(arg, &st) != 0) {
+            *result = false;
+            return true;
+        }
+        switch (op[1]) {
+        case 'e': *result = true; break;
+        case 'd': *result = S_ISDIR(st.st_mode); break;
+        case 'f': *result = S_ISREG(st.st_mode); break;
+        case 's': *result = st.st_size > 0; break;
+        case 'b': *result = S_ISBLK(st.st_mode); break;
+        case 'c': *result = S_ISCHR(st.st_mode); break;
+        case 'p': *result = S_ISFIFO(st.st_mode); break;
+        case 'S': *result = S_ISSOCK(st.st_mode); break;
+        case 'g': *result = (st.st_mode & S_ISGID) != 0; break;
+        case 'u': *result = (st.st_mode & S_ISUID) != 0; break;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool test_binary_op(const char *op) {
+    static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool test_binary(TestParser *t, const char *a, const char *op, const char *b) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(a, b) == 0;
+    }
+    if (strcmp(op, "!=") == 0) {
+        return strcmp(a, b) != 0;
+    }
+    if (strcmp(op, "<") == 0) {
+        return strcmp(a, b) < 0;
+    }
+    if (strcmp(op, ">") == 0) {
+        return strcmp(a, b) > 0;
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat sa, sb;
+        bool ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') {
+            return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        }
+        if (op[1] == 'n') {
+            return ha && (!hb || sa.st_mtime > sb.st_mtime);
+        }
+        return hb && (!ha || sa.st_mtime < sb.st_mtime);
+    }
+
+    long long x, y;
+    if (!test_integer(t, a, &x) || !test_integer(t, b, &y)) {
+        return false;
+    }
+    if (strcmp(op, "-eq") == 0) {
+        return x == y;
+    } else if (strcmp(op, "-ne") == 0) {
+        return x != y;
+    } else if (strcmp(op, "-lt") == 0) {
+        return x < y;
+    } else if (strcmp(op, "-le") == 0) {
+        return x <= y;
+    } else if (strcmp(op, "-gt") == 0) {
+        return x > y;
+    }
+    return x >= y;
+}
+
+static bool test_primary(TestParser *t) {
+    int left = t->argc - t->pos;
+    if (left <= 0) {
+        fprintf(stderr, "wsh: test: argument expected\n");
+        t->error = true;
+        return false;
+    }
+    char *a = t->argv[t->pos];
+
+    // a binary operator in second place wins over a leading unary or paren
+    if (left >= 3 && test_binary_op(t->argv[t->pos + 1])) {
+        t->pos += 3;
+        return test_binary(t, a, t->argv[t->pos - 2], t->argv[t->pos - 1]);
+    }
+    if (strcmp(a, "!") == 0 && left >= 2) {
+        t->pos++;
+        return !test_primary(t);
+    }
+    if (strcmp(a, "(") == 0 && left >= 2) {
+        t->pos++;
+        bool result = test_expr(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0) {
+            fprintf(stderr, "wsh: test: `)' expected\n");
+            t->error = true;
+            return false;
+        }
+        t->pos++;
+        return result;
+    }
+    bool result = false;
+    if (left >= 2 && a[0] == '-' && test_unary(a, t->argv[t->pos + 1], &result)) {
+        t->pos += 2;
+        return result;
+    }
+    t->pos++;
+    return a[0] != '\0';
+}
+
+static bool test_and(TestParser *t) {
+    bool result = test_primary(t);
+    while (!t->error && t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        bool rhs = test_primary(t);
+        result = result && rhs;
+    }
+    return result;
+}
+
+static bool test_expr(TestParser *t) {
+    bool result = test_and(t);
+    while (!t->error && t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        bool rhs = test_and(t);
+        result = result || rhs;
+    }
+    return result;
+}
+
+// test EXPR and [ EXPR ]: 0 true, 1 false, 2 on a malformed expression
+static int test_builtin(char **args) {
+    int argc = 0;
+    while (args[argc] != NULL) {
+        argc++;
+    }
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[argc - 1], "]") != 0) {
+            fprintf(stderr, "wsh: [: missing `]'\n");
+            return 2;
+        }
+        argc--;
+    }
+    if (argc == 1) {
+        return 1;
+    }
+
+    TestParser t = { args, 1, argc, false };
+    bool result = test_expr(&t);
+    if (!t.error && t.pos != t.argc) {
+        fprintf(stderr, "wsh: test: %s: unexpected argument\n", args[t.pos]);
+        t.error = true;
+    }
+    if (t.error) {
+        return 2;
+    }
+    return result ? 0 : 1;
+}
+
+// sleep DURATION..., durations may be fractional with an s/m/h/d suffix
+static int sleep_builtin(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "wsh: sleep: missing operand\n");
+        return 1;
+    }
+    double total = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        double seconds;
+        if (!parse_duration(args[i], &seconds)) {
+            fprintf(stderr, "wsh: sleep: invalid time interval '%s'\n", args[i]);
+            return 1;
+        }
+        total += seconds;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)total;
+    ts.tv_nsec = (long)((total - (double)ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+        // resume with the remaining time
+    }
+    return 0;
+}
+
+static bool is_identifier(const char *s) {
+    if (!isalpha((unsigned char)*s) && *s != '_') {
+        return false;
+    }
+    while (isalnum((unsigned char)*++s) || *s == '_') {
+    }
+    return *s == '\0';
+}
+
+// assigns to an exported variable in place, otherwise to a shell variable
+static void read_assign(const char *name, const char *value) {
+    if (getenv(name) != NULL) {
+        setenv(name, value, 1);
+    } else if (set_shell_var(name, value) == NULL) {
+        fprintf(stderr, "wsh: read: %s: too many variables\n", name);
+    }
+}
+
+// read [-r] [-d delim] [-n N] [var...], one line from stdin split on $IFS;
+// the last variable takes the rest of the line, REPLY the whole of it
+static int read_builtin(char **args) {
+    bool raw = false;
+    int delim = '\n';
+    long limit = -1;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            raw = true;
+        } else if (strcmp(args[i], "-d") == 0 && args[i + 1] != NULL) {
+            delim = (unsigned char)args[++i][0];  // -d '' reads up to a NUL
+        } else if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL) {
+            char *endptr;
+            limit = strtol(args[++i], &endptr, 10);
+            if (*args[i] == '\0' || *endptr != '\0' || limit < 0) {
+                fprintf(stderr, "wsh: read: %s: invalid number\n", args[i]);
+                return 2;
+            }
+        } else {
+            fprintf(stderr, "wsh: read: %s: invalid option\n", args[i]);
+            fprintf(stderr, "usage: read [-r] [-d delim] [-n N] [name ...]\n");
+            return 2;
+        }
+    }
+    for (int k = i; args[k] != NULL; k++) {
+        if (!is_identifier(args[k])) {
+            fprintf(stderr, "wsh: read: `%s': not a valid identifier\n", args[k]);
+            return 1;
+        }
+    }
+
+    // escaped[] marks backslash-quoted bytes, which never split fields
+    size_t cap = 256, len = 0;
+    char *line = arena_alloc(cap);
+    char *escaped = arena_alloc(cap);
+    ReadAhead *ra = read_ahead_for(STDIN_FILENO);
+    bool eof = false;
+    while (limit < 0 || (long)len < limit) {
+        int c = read_ahead_byte(STDIN_FILENO, ra);
+        if (c < 0) {
+            eof = true;
+            break;
+        }
+        if (c == delim) {
+            break;
+        }
+        if (c == '\0') {
+            continue;  // variables cannot hold NUL bytes
+        }
+        bool quoted = false;
+        if (c == '\\' && !raw) {
+            c = read_ahead_byte(STDIN_FILENO, ra);
+            if (c < 0) {
+                eof = true;
+                break;
+            }
+            if (c == '\n') {
+                continue;  // line continuation
+            }
+            quoted = true;
+        }
+        if (len + 1 == cap) {
+            line = arena_grow(line, cap, cap * 2);
+            escaped = arena_grow(escaped, cap, cap * 2);
+            cap *= 2;
+        }
+        escaped[len] = quoted;
+        line[len++] = c;
+    }
+    line[len] = '\0';
+
+    if (args[i] == NULL) {
+        read_assign("REPLY", line);
+        return eof ? 1 : 0;
+    }
+
+    // classify each byte: 0 plain, 1 IFS whitespace, 2 other IFS separator
+    const char *ifs = get_var_value("IFS");
+    if (ifs == NULL) {
+        ifs = " \t\n";
+    }
+    char *cls = escaped;
+    for (size_t k = 0; k < len; k++) {
+        bool sep = !escaped[k] && strchr(ifs, line[k]) != NULL;
+        cls[k] = !sep ? 0 : isspace((unsigned char)line[k]) ? 1 : 2;
+    }
+    cls[len] = 0;
+
+    size_t pos = 0;
+    while (cls[pos] == 1) {
+        pos++;
+    }
+    for (; args[i] != NULL; i++) {
+        size_t start = pos;
+        if (args[i + 1] == NULL) {
+            // the last name gets the rest, less trailing IFS whitespace
+            size_t end = len;
+            while (end > start && cls[end - 1] == 1) {
+                end--;
+            }
+            line[end] = '\0';
+            read_assign(args[i], line + start);
+            break;
+        }
+        while (pos < len && cls[pos] == 0) {
+            pos++;
+        }
+        size_t end = pos;
+        while (cls[pos] == 1) {
+            pos++;
+        }
+        if (cls[pos] == 2) {
+            pos++;  // one non-whitespace separator, with whitespace around it
+            while (cls[pos] == 1) {
+                pos++;
+            }
+        }
+        char saved = line[end];
+        line[end] = '\0';
+        read_assign(args[i], line + start);
+        line[end] = saved;
+    }
+    return eof ? 1 : 0;
+}
+
+// core and loaded builtins share builtin_table; lookups go through a slot
+// table whose hash seed is re-picked on every registration so that no two
+// names collide, making dispatch one hash and one strcmp
+#define BUILTIN_SLOTS 512
+
+static const WshBuiltin *builtin_plugins[MAX_BUILTINS];    // NULL for core builtins
+static int builtin_count = 0;
+static unsigned char builtin_slots[BUILTIN_SLOTS];         // table index + 1, 0 when empty
+static uint64_t builtin_seed = 0;
+
+static unsigned int builtin_slot(const char *name, uint64_t seed) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (; *name != '\0'; name++) {
+        h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+    }
+    h = (h ^ seed) * 0xbf58476d1ce4e5b9ULL;
+    return (h ^ h >> 31) & (BUILTIN_SLOTS - 1);
+}
+
+// first seed from the current one that gives every name a slot of its own
+static void builtin_rehash() {
+    for (uint64_t seed = builtin_seed;; seed++) {
+        memset(builtin_slots, 0, sizeof(builtin_slots));
+        int i = 0;
+        for (; i < builtin_count; i++) {
+            unsigned int slot = builtin_slot(builtin_table[i].name, seed);
+            if (builtin_slots[slot] != 0) {
+                break;
+            }
+            builtin_slots[slot] = i + 1;
+        }
+        if (i == builtin_count) {
+            builtin_seed = seed;
+            return;
+        }
+    }
+}
+
+static const char *plugin_get_var(const char *name) {
+    return get_var_value(name);
+}
+
+static int plugin_set_var(const char *name, const char *value) {
+    return is_identifier(name) && set_shell_var(name, value) != NULL ? 0 : -1;
+}
+
+// loaded builtins run in the shell like cd, on the already redirected fds
+static int plugin_call(const WshBuiltin *plugin, char **args) {
+    int argc = 0;
+    while (args[argc] != NULL) {
+        argc++;
+    }
+    WshContext ctx = { WSH_PLUGIN_ABI, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, last_exit_status,
+                       plugin_get_var, plugin_set_var };
+    return plugin->run(argc, args, &ctx);
+}
+
+static int builtin_register(const char *name, const WshBuiltin *plugin) {
+    const Builtin *existing = find_builtin(name);
+    if (existing != NULL) {
+        int index = existing - builtin_table;
+        if (builtin_plugins[index] == NULL) {
+            fprintf(stderr, "wsh: enable: %s: cannot replace a core builtin\n", name);
+            return -1;
+        }
+        builtin_plugins[index] = plugin;  // a newer build of the same tool
+        return 0;
+    }
+    if (builtin_count == MAX_BUILTINS - 1) {
+        fprintf(stderr, "wsh: enable: %s: too many builtins\n", name);
+        return -1;
+    }
+    char *copy = strdup(name);
+    if (copy == NULL) {
+        fprintf(stderr, "wsh: enable: %s: %s\n", name, strerror(ENOMEM));
+        return -1;
+    }
+    builtin_plugins[builtin_count] = plugin;
+    builtin_table[builtin_count] = (Builtin){ copy, NULL, true, false };
+    metrics_name_builtin(builtin_count, copy);
+    builtin_count++;
+    builtin_rehash();
+    return 0;
+}
+
+// enable [-f plugin.so name...]: lists the builtins, or loads each name's
+// <name>_wsh_builtin from plugin.so
+static int enable_builtin(char **args) {
+    if (args[1] == NULL) {
+        for (int i = 0; i < builtin_count; i++) {
+            fprintf(builtin_stdout(), "enable %s%s\n", builtin_table[i].name, builtin_plugins[i] ? " (loaded)" : "");
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "-f") != 0 || args[2] == NULL || args[3] == NULL) {
+        fprintf(stderr, "wsh: enable: usage: enable [-f plugin.so name...]\n");
+        return 2;
+    }
+    void *handle = dlopen(args[2], RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        fprintf(stderr, "wsh: enable: %s\n", dlerror());
+        return 1;
+    }
+    // the handle stays open, registered builtins point into it
+    int status = 0;
+    for (int i = 3; args[i] != NULL; i++) {
+        char symbol[256];
+        snprintf(symbol, sizeof(symbol), "%s_wsh_builtin", args[i]);
+        const WshBuiltin *plugin = dlsym(handle, symbol);
+        if (plugin == NULL) {
+            fprintf(stderr, "wsh: enable: %s: no %s in %s\n", args[i], symbol, args[2]);
+            status = 1;
+        } else if (plugin->abi < 1 || plugin->abi > WSH_PLUGIN_ABI || plugin->run == NULL) {
+            fprintf(stderr, "wsh: enable: %s: built for plugin ABI %d, this shell has %d\n", args[i], plugin->abi,
+                    WSH_PLUGIN_ABI);
+            status = 1;
+        } else if (builtin_register(args[i], plugin) != 0) {
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// core builtins, followed by any that enable -f loads; shared by
+// process_builtin, history filtering, completion and metrics
+Builtin builtin_table[MAX_BUILTINS] = {
+    { "cd", cd_builtin, false, false },
+    { "j", jump_builtin, false, false },
+    { "pwd", pwd_builtin, true, true },
+    { "export", export_builtin, false, false },
+    { "local", local_builtin, false, false },
+    { "vars", vars_builtin, false, true },
+    { "history", process_history_builtin, false, true },
+    { "ls", ls_builtin, false, true },
+    { "walk", walk_builtin, false, true },
+    { "run", run_builtin, true, false },
+    { "sched", sched_builtin, false, false },
+    { "exit", exit_builtin, false, false },
+    { "echo", echo_builtin, true, true },
+    { "printf", printf_builtin, true, true },
+    { "test", test_builtin, true, true },
+    { "[", test_builtin, true, true },
+    { "true", true_builtin, true, true },
+    { "false", false_builtin, true, true },
+    { "sleep", sleep_builtin, true, true },
+    { "read", read_builtin, true, false },
+    { "exec", exec_builtin, true, false },
+    { "memo", memo_builtin, true, false },
+    { "return", return_builtin, false, false },
+    { "timeout", timeout_builtin, true, false },
+    { "stats", stats_builtin, true, true },
+    { "wait", wait_builtin, true, false },
+    { "enable", enable_builtin, true, false },
+};
+
+// counts the core builtins and gives them their slots and metrics names
+void builtins_init() {
+    if (builtin_count > 0) {
+        return;
+    }
+    while (builtin_table[builtin_count].name != NULL) {
+        metrics_name_builtin(builtin_count, builtin_table[builtin_count].name);
+        builtin_count++;
+    }
+    builtin_rehash();
+}
+
+const Builtin *find_builtin(const char *name) {
+    builtins_init();
+    int index = builtin_slots[builtin_slot(name, builtin_seed)];
+    if (index == 0 || strcmp(builtin_table[index - 1].name, name) != 0) {
+        return NULL;
+    }
+    return &builtin_table[index - 1];
+}
+
+int builtin_call(const Builtin *b, char **args) {
+    int index = b - builtin_table;
+    METRIC_ADD(metrics.builtin_calls[index], 1);
+    if (builtin_plugins[index] != NULL) {
+        return plugin_call(builtin_plugins[index], args);
+    }
+    return b->fn(args);
+}
+
+int process_builtin(char **args) {
+    const Builtin *b = find_builtin(args[0]);
+    if (b == NULL) {
+        return -1;
+    }
+    return builtin_call(b, args);
+}
+
+
+// helper for displaying local vars
+void show_vars() {
+    for (int i = 0; i < var_count; i++) {
+        fprintf(builtin_stdout(), "%s=%s\n", shell_vars[i].name, shell_vars[i].value);
+    }
+}
+
+
+
+
+int cmp_entries(const void *a, const void *b) {
+    const char **entryA = (const char **)a;
+    const char **entryB = (const char **)b;
+    return strcmp(*entryA, *entryB);
+}
+
+void ls() {
+    DIR *dir;
+    struct dirent *entry;
+    size_t cap = 256;
+    char **entries = arena_alloc(cap * sizeof(char *));
+    size_t count = 0;
+
+    setlocale(LC_COLLATE, "C");
+
+    dir = opendir(".");
+    if (dir == NULL) {
+        perror("wsh: ls");
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            if (count == cap) {
+                entries = arena_grow(entries, cap * sizeof(char *), cap * 2 * sizeof(char *));
+                cap *= 2;
+            }
+            entries[count++] = arena_strdup(entry->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(entries, count, sizeof(char *), cmp_entries);
+
+    for (size_t i = 0; i < count; i++) {
+        fprintf(builtin_stdout(), "%s\n", entries[i]);
+    }
+}
+
+
+// recursive tree walk (walk builtin, ls -R) on a work-stealing thread pool
+
+// directory fd shared by the entries queued under it
+typedef struct {
+    int fd;
+    atomic_int refs;
+} DirRef;
+
+typedef struct {
+    DirRef *parent;     // NULL for roots, opened relative to cwd
+    char *path;         // path as printed
+    size_t name_off;    // offset of the last component in path
+    int depth;
+} WalkTask;
+
+// per-worker deque: the owner works LIFO at the bottom, thieves take the top
+typedef struct {
+    pthread_mutex_t lock;
+    WalkTask *tasks;
+    size_t top;
+    size_t bottom;
+    size_t cap;
+} WalkDeque;
+
+typedef struct {
+    char *data;
+    size_t len;
+    char **sorted;
+    size_t sorted_count;
+    size_t sorted_cap;
+} WalkOutput;
+
+typedef struct {
+    WalkFilter *filter;
+    WalkDeque *deques;
+    WalkOutput *outputs;
+    int workers;
+    atomic_long pending;    // tasks queued or in progress
+    atomic_int errors;
+    time_t now;
+    pthread_mutex_t out_lock;
+    // idle workers sleep on work until a push bumps pushes or pending hits 0
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work;
+    atomic_ulong pushes;
+    atomic_int sleeping;
+} WalkState;
+
+typedef struct {
+    WalkState *state;
+    int id;
+} WalkWorker;
+
+#define WALK_OUT_SIZE 65536
+
+static void dir_ref_release(DirRef *ref) {
+    if (ref != NULL && atomic_fetch_sub(&ref->refs, 1) == 1) {
+        close(ref->fd);
+        free(ref);
+    }
+}
+
+// queues a directory; false, with the error reported, if it could not be
+// queued, leaving task.path and the parent reference to the caller
+static bool walk_push(WalkState *s, int id, WalkTask task) {
+    WalkDeque *dq = &s->deques[id];
+    if (task.path == NULL) {
+        fprintf(stderr, "wsh: walk: %s\n", strerror(ENOMEM));
+        atomic_fetch_add(&s->errors, 1);
+        return false;
+    }
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom - dq->top == dq->cap) {
+        size_t cap = dq->cap ? dq->cap * 2 : 256;
+        WalkTask *grown = malloc(cap * sizeof(WalkTask));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            fprintf(stderr, "wsh: walk: %s: %s\n", task.path, strerror(ENOMEM));
+            atomic_fetch_add(&s->errors, 1);
+            return false;
+        }
+        for (size_t i = dq->top; i < dq->bottom; i++) {
+            grown[i - dq->top] = dq->tasks[i % dq->cap];
+        }
+        free(dq->tasks);
+        dq->tasks = grown;
+        dq->bottom -= dq->top;
+        dq->top = 0;
+        dq->cap = cap;
+    }
+    // counted before it becomes visible, so no worker sees pending drop to 0
+    atomic_fetch_add(&s->pending, 1);
+    dq->tasks[dq->bottom++ % dq->cap] = task;
+    pthread_mutex_unlock(&dq->lock);
+    atomic_fetch_add(&s->pushes, 1);
+    if (atomic_load(&s->sleeping) > 0) {
+        pthread_mutex_lock(&s->idle_lock);
+        pthread_cond_signal(&s->work);
+        pthread_mutex_unlock(&s->idle_lock);
+    }
+    return true;
+}
+
+static bool walk_take(WalkState *s, int id, bool steal, WalkTask *task) {
+    WalkDeque *dq = &s->deques[id];
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *task = steal ? dq->tasks[dq->top++ % dq->cap] : dq->tasks[--dq->bottom % dq->cap];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static void walk_flush(WalkState *s, WalkOutput *out) {
+    if (out->len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&s->out_lock);
+    size_t done = 0;
+    while (done < out->len) {
+        ssize_t n = write(STDOUT_FILENO, out->data + done, out->len - done);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+    pthread_mutex_unlock(&s->out_lock);
+    out->len = 0;
+}
+
+static void walk_emit(WalkState *s, WalkOutput *out, const char *path) {
+    size_t len = strlen(path);
+    if (s->filter->sorted) {
+        if (out->sorted_count == out->sorted_cap) {
+            size_t cap = out->sorted_cap ? out->sorted_cap * 2 : 1024;
+            char **grown = realloc(out->sorted, cap * sizeof(char *));
+            if (grown == NULL) {
+                fprintf(stderr, "wsh: walk: %s: %s\n", path, strerror(ENOMEM));
+                atomic_fetch_add(&s->errors, 1);
+                return;
+            }
+            out->sorted = grown;
+            out->sorted_cap = cap;
+        }
+        char *copy = strdup(path);
+        if (copy == NULL) {
+            fprintf(stderr, "wsh: walk: %s: %s\n", path, strerror(ENOMEM));
+            atomic_fetch_add(&s->errors, 1);
+            return;
+        }
+        out->sorted[out->sorted_count++] = copy;
+        return;
+    }
+    if (out->len + len + 1 > WALK_OUT_SIZE) {
+        walk_flush(s, out);
+    }
+    if (len + 1 > WALK_OUT_SIZE) {
+        return;
+    }
+    memcpy(out->data + out->len, path, len);
+    out->data[out->len + len] = '\n';
+    out->len += len + 1;
+}
+
+static bool walk_compare(int cmp, long long have, long long want) {
+    if (cmp == 1) {
+        return have > want;
+    }
+    if (cmp == -1) {
+        return have < want;
+    }
+    return have == want;
+}
+
+static bool walk_matches(WalkState *s, const char *name, char type, struct stat *st) {
+    WalkFilter *f = s->filter;
+    if (f->type != 0 && f->type != type) {
+        return false;
+    }
+    if (f->name_pattern != NULL && fnmatch(f->name_pattern, name, 0) != 0) {
+        return false;
+    }
+    if (f->size_cmp != 2) {
+        long long units = (st->st_size + f->size_unit - 1) / f->size_unit;
+        if (!walk_compare(f->size_cmp, units, f->size)) {
+            return false;
+        }
+    }
+    if (f->mtime_cmp != 2) {
+        long long age = (s->now - st->st_mtime) / 86400;
+        if (!walk_compare(f->mtime_cmp, age, f->mtime_days)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static char dirent_type(unsigned char d_type) {
+    switch (d_type) {
+    case DT_DIR:
+        return 'd';
+    case DT_LNK:
+        return 'l';
+    case DT_REG:
+        return 'f';
+    case DT_UNKNOWN:
+        return 0;
+    default:
+        return '?';
+    }
+}
+
+static char stat_type(mode_t mode) {
+    if (S_ISDIR(mode)) {
+        return 'd';
+    }
+    if (S_ISLNK(mode)) {
+        return 'l';
+    }
+    return S_ISREG(mode) ? 'f' : '?';
+}
+
+static void walk_dir(WalkState *s, int id, WalkTask *task) {
+    int parent_fd = task->parent ? task->parent->fd : AT_FDCWD;
+    const char *name = task->parent ? task->path + task->name_off : task->path;
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 && errno == EMFILE) {
+        fd = open(task->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    dir_ref_release(task->parent);
+    if (fd < 0) {
+        fprintf(stderr, "wsh: walk: %s: %s\n", task->path, strerror(errno));
+        atomic_fetch_add(&s->errors, 1);
+        return;
+    }
+
+    int list_fd = dup(fd);
+    DIR *dir = list_fd < 0 ? NULL : fdopendir(list_fd);
+    DirRef *ref = dir == NULL ? NULL : malloc(sizeof(DirRef));
+    if (ref == NULL) {
+        fprintf(stderr, "wsh: walk: %s: %s\n", task->path, strerror(dir == NULL ? errno : ENOMEM));
+        if (dir != NULL) {
+            closedir(dir);
+        } else if (list_fd >= 0) {
+            close(list_fd);
+        }
+        close(fd);
+        atomic_fetch_add(&s->errors, 1);
+        return;
+    }
+    ref->fd = fd;
+    atomic_init(&ref->refs, 1);
+
+    WalkFilter *f = s->filter;
+    WalkOutput *out = &s->outputs[id];
+    bool descend = f->max_depth < 0 || task->depth < f->max_depth;
+    bool bare = f->bare_root && task->parent == NULL && strcmp(task->path, ".") == 0;
+    size_t dir_len = bare ? 0 : strlen(task->path);
+    bool has_slash = dir_len > 0 && task->path[dir_len - 1] == '/';
+    char path[PATH_MAX];
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *d = entry->d_name;
+        if (d[0] == '.' && (d[1] == '\0' || (d[1] == '.' && d[2] == '\0'))) {
+            continue;
+        }
+        if (f->skip_hidden && d[0] == '.') {
+            continue;
+        }
+
+        struct stat st;
+        char type = dirent_type(entry->d_type);
+        if (type == 0 || f->need_stat) {
+            if (fstatat(fd, d, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = stat_type(st.st_mode);
+        }
+
+        int n = snprintf(path, sizeof(path), "%s%s%s", bare ? "" : task->path, (bare || has_slash) ? "" : "/", d);
+        if (n < 0 || (size_t)n >= sizeof(path)) {
+            continue;
+        }
+        if (walk_matches(s, d, type, &st)) {
+            walk_emit(s, out, path);
+        }
+        if (type == 'd' && descend) {
+            WalkTask child = { ref, strdup(path), n - strlen(d), task->depth + 1 };
+            atomic_fetch_add(&ref->refs, 1);
+            if (!walk_push(s, id, child)) {
+                free(child.path);
+                atomic_fetch_sub(&ref->refs, 1);
+            }
+        }
+    }
+    closedir(dir);
+    dir_ref_release(ref);
+}
+
+static void *walk_worker(void *arg) {
+    WalkWorker *w = arg;
+    WalkState *s = w->state;
+    unsigned int seed = w->id + 1;
+
+    while (1) {
+        unsigned long pushes = atomic_load(&s->pushes);
+        WalkTask task;
+        bool found = walk_take(s, w->id, false, &task);
+        for (int i = 0; !found && i < s->workers; i++) {
+            int victim = (w->id + 1 + i + rand_r(&seed) % s->workers) % s->workers;
+            if (victim != w->id) {
+                found = walk_take(s, victim, true, &task);
+            }
+        }
+        if (!found) {
+            if (atomic_load(&s->pending) == 0) {
+                break;
+            }
+            // nothing to steal yet: sleep until something is pushed after the scan above.
+            // sleeping is raised before pushes is rechecked, so a push either shows up
+            // in the check or sees a sleeper and signals
+            walk_flush(s, &s->outputs[w->id]);
+            pthread_mutex_lock(&s->idle_lock);
+            atomic_fetch_add(&s->sleeping, 1);
+            while (atomic_load(&s->pushes) == pushes && atomic_load(&s->pending) > 0) {
+                pthread_cond_wait(&s->work, &s->idle_lock);
+            }
+            atomic_fetch_sub(&s->sleeping, 1);
+            pthread_mutex_unlock(&s->idle_lock);
+            continue;
+        }
+        walk_dir(s, w->id, &task);
+        free(task.path);
+        if (atomic_fetch_sub(&s->pending, 1) == 1) {
+            pthread_mutex_lock(&s->idle_lock);
+            pthread_cond_broadcast(&s->work);  // the walk is over
+            pthread_mutex_unlock(&s->idle_lock);
+        }
+    }
+    walk_flush(s, &s->outputs[w->id]);
+    return NULL;
+}
+
+int walk_paths(char **roots, int nroots, WalkFilter *filter, int threads) {
+    WalkState s;
+    memset(&s, 0, sizeof(s));
+    s.filter = filter;
+    s.workers = threads;
+    s.now = time(NULL);
+    atomic_init(&s.pending, 0);
+    atomic_init(&s.errors, 0);
+    pthread_mutex_init(&s.out_lock, NULL);
+    pthread_mutex_init(&s.idle_lock, NULL);
+    pthread_cond_init(&s.work, NULL);
+    atomic_init(&s.pushes, 0);
+    atomic_init(&s.sleeping, 0);
+    s.deques = calloc(threads, sizeof(WalkDeque));
+    s.outputs = calloc(threads, sizeof(WalkOutput));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    WalkWorker *workers = malloc(threads * sizeof(WalkWorker));
+    bool allocated = s.deques != NULL && s.outputs != NULL && tids != NULL && workers != NULL;
+    for (int i = 0; allocated && i < threads; i++) {
+        s.outputs[i].data = malloc(WALK_OUT_SIZE);
+        allocated = s.outputs[i].data != NULL;
+    }
+    if (!allocated) {
+        fprintf(stderr, "wsh: walk: %s\n", strerror(ENOMEM));
+        for (int i = 0; s.outputs != NULL && i < threads; i++) {
+            free(s.outputs[i].data);
+        }
+        free(s.deques);
+        free(s.outputs);
+        free(tids);
+        free(workers);
+        pthread_mutex_destroy(&s.out_lock);
+        pthread_mutex_destroy(&s.idle_lock);
+        pthread_cond_destroy(&s.work);
+        return 1;
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&s.deques[i].lock, NULL);
+    }
+
+    fflush(stdout);
+    for (int i = 0; i < nroots; i++) {
+        struct stat st;
+        if (lstat(roots[i], &st) != 0) {
+            fprintf(stderr, "wsh: walk: %s: %s\n", roots[i], strerror(errno));
+            atomic_fetch_add(&s.errors, 1);
+            continue;
+        }
+        bool bare = filter->bare_root && strcmp(roots[i], ".") == 0;
+        const char *base = strrchr(roots[i], '/');
+        base = (base != NULL && base[1] != '\0') ? base + 1 : roots[i];
+        if (!bare && walk_matches(&s, base, stat_type(st.st_mode), &st)) {
+            walk_emit(&s, &s.outputs[0], roots[i]);
+        }
+        if (S_ISDIR(st.st_mode) && filter->max_depth != 0) {
+            WalkTask root = { NULL, strdup(roots[i]), 0, 1 };
+            if (!walk_push(&s, i % threads, root)) {
+                free(root.path);
+            }
+        }
+    }
+
+    int started = 0;
+    for (int i = 1; i < threads; i++) {
+        workers[i].state = &s;
+        workers[i].id = i;
+        if (pthread_create(&tids[i], NULL, walk_worker, &workers[i]) != 0) {
+            break;
+        }
+        started = i;
+    }
+    // thieves cover for any worker that failed to start
+    s.workers = started + 1;
+    workers[0].state = &s;
+    workers[0].id = 0;
+    walk_worker(&workers[0]);
+    for (int i = 1; i <= started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    if (filter->sorted) {
+        size_t total = 0;
+        for (int i = 0; i < threads; i++) {
+            total += s.outputs[i].sorted_count;
+        }
+        char **all = malloc((total + 1) * sizeof(char *));
+        if (all == NULL) {
+            fprintf(stderr, "wsh: walk: %s\n", strerror(ENOMEM));
+            atomic_fetch_add(&s.errors, 1);
+            for (int i = 0; i < threads; i++) {
+                for (size_t j = 0; j < s.outputs[i].sorted_count; j++) {
+                    free(s.outputs[i].sorted[j]);
+                }
+            }
+        } else {
+            size_t k = 0;
+            for (int i = 0; i < threads; i++) {
+                memcpy(all + k, s.outputs[i].sorted, s.outputs[i].sorted_count * sizeof(char *));
+                k += s.outputs[i].sorted_count;
+            }
+            qsort(all, total, sizeof(char *), cmp_entries);
+            filter->sorted = false;
+            for (size_t i = 0; i < total; i++) {
+                walk_emit(&s, &s.outputs[0], all[i]);
+                free(all[i]);
+            }
+            filter->sorted = true;
+            walk_flush(&s, &s.outputs[0]);
+            free(all);
+        }
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&s.deques[i].lock);
+        free(s.deques[i].tasks);
+        free(s.outputs[i].data);
+        free(s.outputs[i].sorted);
+    }
+    free(s.deques);
+    free(s.outputs);
+    free(tids);
+    free(workers);
+    pthread_mutex_destroy(&s.out_lock);
+    pthread_mutex_destroy(&s.idle_lock);
+    pthread_cond_destroy(&s.work);
+    return atomic_load(&s.errors) > 0 ? 1 : 0;
+}
+
+// parses [+-]N with an optional c/k/M/G suffix
+static bool walk_parse_number(const char *arg, int *cmp, long long *value, off_t *unit) {
+    *cmp = 0;
+    if (*arg == '+' || *arg == '-') {
+        *cmp = *arg == '+' ? 1 : -1;
+        arg++;
+    }
+    char *endptr;
+    errno = 0;
+    *value = strtoll(arg, &endptr, 10);
+    if (endptr == arg || errno != 0 || *value < 0) {
+        return false;
+    }
+    if (unit == NULL) {
+        return *endptr == '\0';
+    }
+    switch (*endptr) {
+    case '\0':
+    case 'c':
+        *unit = 1;
+        break;
+    case 'k':
+        *unit = 1024;
+        break;
+    case 'M':
+        *unit = 1024 * 1024;
+        break;
+    case 'G':
+        *unit = 1024L * 1024 * 1024;
+        break;
+    default:
+        return false;
+    }
+    return *endptr == '\0' || endptr[1] == '\0';
+}
+
+// walk [-j N] [-s] [-maxdepth N] [-name PAT] [-type f|d|l] [-size [+-]N[ckMG]] [-mtime [+-]N] [path...]
+int walk_builtin(char **args) {
+    WalkFilter filter = WALK_FILTER_INIT;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int argc = 0;
+    while (args[argc] != NULL) {
+        argc++;
+    }
+    char **roots = arena_alloc((argc + 1) * sizeof(char *));
+    int nroots = 0;
+
+    for (int i = 1; args[i] != NULL; i++) {
+        char *opt = args[i];
+        char *val = args[i + 1];
+        long long n;
+        int cmp;
+        bool needs_val = opt[0] == '-' && strcmp(opt, "-s") != 0;
+        if (needs_val && val == NULL) {
+            fprintf(stderr, "wsh: walk: %s: missing argument\n", opt);
+            return 1;
+        }
+
+        if (strcmp(opt, "-s") == 0) {
+            filter.sorted = true;
+            continue;
+        } else if (strcmp(opt, "-j") == 0 && walk_parse_number(val, &cmp, &n, NULL) && cmp == 0 && n > 0) {
+            threads = n;
+        } else if (strcmp(opt, "-maxdepth") == 0 && walk_parse_number(val, &cmp, &n, NULL) && cmp == 0) {
+            filter.max_depth = n;
+        } else if (strcmp(opt, "-name") == 0) {
+            filter.name_pattern = val;
+        } else if (strcmp(opt, "-type") == 0 && strchr("fdl", val[0]) != NULL && val[1] == '\0') {
+            filter.type = val[0];
+        } else if (strcmp(opt, "-size") == 0 && walk_parse_number(val, &filter.size_cmp, &n, &filter.size_unit)) {
+            filter.size = n;
+            filter.need_stat = true;
+        } else if (strcmp(opt, "-mtime") == 0 && walk_parse_number(val, &filter.mtime_cmp, &n, NULL)) {
+            filter.mtime_days = n;
+            filter.need_stat = true;
+        } else if (opt[0] != '-') {
+            roots[nroots++] = opt;
+            continue;
+        } else {
+            fprintf(stderr, "wsh: walk: invalid option %s\n", opt);
+            return 1;
+        }
+        i++;
+    }
+    if (nroots == 0) {
+        roots[nroots++] = ".";
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    return walk_paths(roots, nroots, &filter, threads);
+}
+
+
+// frecency index of visited directories for cd -j and j: one mmapped file
+// holding a header, an open addressing hash of entry numbers, a dense array
+// of 128-bit blooms over each path's characters and character pairs, the
+// entries and a string pool. A lookup streams through the blooms alone and
+// only reads the entries and strings that can match. Shells sharing the
+// file take flock around every access and remap when another one grew it.
+
+#define JUMP_MAGIC "WSHJUMP2"
+#define JUMP_MIN_SLOTS 1024
+#define JUMP_MIN_POOL 65536
+#define JUMP_MAX_TOTAL 100000   // total rank before everything is aged
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t slots;             // power of two, room for slots / 2 entries
+    uint64_t pool_used;
+    uint64_t pool_cap;
+    double total;               // sum of ranks
+    uint64_t generation;        // bumped by every format, so same-size rewrites are noticed
+} JumpHeader;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t path_off;
+    uint32_t path_len;
+    double rank;
+    int64_t last_visit;
+} JumpEntry;
+
+static int jump_fd = -1;
+static char *jump_map = NULL;
+static size_t jump_size = 0;
+static bool jump_checked = false;       // the map passed a full check at jump_checked_generation
+static uint64_t jump_checked_generation = 0;
+
+#define JUMP_HEADER ((JumpHeader *)jump_map)
+#define JUMP_INDEX ((uint32_t *)(jump_map + sizeof(JumpHeader)))    // entry number + 1, 0 if free
+#define JUMP_MASKS ((uint64_t (*)[2])(JUMP_INDEX + JUMP_HEADER->slots))
+#define JUMP_ENTRIES ((JumpEntry *)(JUMP_MASKS + JUMP_HEADER->slots / 2))
+#define JUMP_POOL ((char *)(JUMP_ENTRIES + JUMP_HEADER->slots / 2))
+
+static size_t jump_file_size(uint32_t slots, uint64_t pool_cap) {
+    return sizeof(JumpHeader) + slots * sizeof(uint32_t) +
+           slots / 2 * (2 * sizeof(uint64_t) + sizeof(JumpEntry)) + pool_cap;
+}
+
+static uint64_t jump_hash(const char *s, size_t len) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// sets a bloom bit for every character and adjacent pair, case folded
+static void jump_mask(const char *s, uint64_t mask[2]) {
+    unsigned int prev = 0;
+    for (; *s != '\0'; s++) {
+        unsigned int c = tolower((unsigned char)*s);
+        unsigned int bit = (c * 2654435761u) >> 25;
+        mask[bit >> 6] |= 1ULL << (bit & 63);
+        if (prev != 0) {
+            bit = ((prev << 8 | c) * 2654435761u) >> 25;
+            mask[bit >> 6] |= 1ULL << (bit & 63);
+        }
+        prev = c;
+    }
+}
+
+static bool jump_map_file(size_t size) {
+    if (jump_map != NULL) {
+        munmap(jump_map, jump_size);
+    }
+    jump_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, jump_fd, 0);
+    if (jump_map == MAP_FAILED) {
+        jump_map = NULL;
+        jump_size = 0;
+        return false;
+    }
+    jump_size = size;
+    jump_checked = false;
+    return true;
+}
+
+// lays out an empty index of the given geometry; caller holds LOCK_EX
+static bool jump_format(uint32_t slots, uint64_t pool_cap) {
+    size_t size = jump_file_size(slots, pool_cap);
+    uint64_t generation = jump_map != NULL && jump_size >= sizeof(JumpHeader) ? JUMP_HEADER->generation + 1 : 1;
+    if (ftruncate(jump_fd, 0) != 0 || ftruncate(jump_fd, size) != 0 || !jump_map_file(size)) {
+        return false;
+    }
+    memcpy(JUMP_HEADER->magic, JUMP_MAGIC, 8);
+    JUMP_HEADER->slots = slots;
+    JUMP_HEADER->pool_cap = pool_cap;
+    JUMP_HEADER->generation = generation;
+    jump_checked = true;  // freshly laid out, nothing to scan
+    jump_checked_generation = generation;
+    return true;
+}
+
+// the header agrees with the file size and every entry, index slot and path
+// lies inside the map; anything else is a damaged file that gets rebuilt.
+// The entries are only scanned after a new map or another shell's format,
+// ordinary locks check the header alone
+static bool jump_valid() {
+    if (jump_map == NULL || jump_size < sizeof(JumpHeader) || memcmp(JUMP_HEADER->magic, JUMP_MAGIC, 8) != 0) {
+        return false;
+    }
+    JumpHeader *h = JUMP_HEADER;
+    if (h->slots < 2 || (h->slots & (h->slots - 1)) != 0 || h->slots > jump_size / sizeof(uint32_t) ||
+        h->pool_cap > jump_size || jump_file_size(h->slots, h->pool_cap) != jump_size ||
+        h->count > h->slots / 2 || h->pool_used > h->pool_cap) {
+        return false;
+    }
+    if (jump_checked && h->generation == jump_checked_generation) {
+        return true;
+    }
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < h->slots; i++) {
+        if (JUMP_INDEX[i] > h->count) {
+            return false;
+        }
+        used += JUMP_INDEX[i] != 0;
+    }
+    if (used != h->count) {
+        return false;  // lookups rely on free slots to stop probing
+    }
+    for (uint32_t i = 0; i < h->count; i++) {
+        const JumpEntry *e = &JUMP_ENTRIES[i];
+        if ((uint64_t)e->path_off + e->path_len >= h->pool_used || JUMP_POOL[e->path_off + e->path_len] != '\0') {
+            return false;
+        }
+    }
+    jump_checked = true;
+    jump_checked_generation = h->generation;
+    return true;
+}
+
+// locks the index, opening it on first use and remapping if it changed size;
+// batch scripts only get one when they name it in $WSH_JUMP_FILE, so they
+// leave nothing behind in ~
+static bool jump_lock(int op) {
+    if (jump_fd < 0) {
+        char path[PATH_MAX];
+        const char *file = getenv("WSH_JUMP_FILE");
+        const char *home = getenv("HOME");
+        if (file != NULL) {
+            snprintf(path, sizeof(path), "%s", file);
+        } else if (home != NULL && interactive_mode) {
+            snprintf(path, sizeof(path), "%s/.wsh_jump", home);
+        } else {
+            return false;
+        }
+        jump_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (jump_fd < 0) {
+            return false;
+        }
+    }
+    if (flock(jump_fd, op) != 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(jump_fd, &st) != 0) {
+        flock(jump_fd, LOCK_UN);
+        return false;
+    }
+    if ((size_t)st.st_size != jump_size && st.st_size > 0) {
+        jump_map_file(st.st_size);
+    }
+    if (!jump_valid()) {
+        // new, unreadable or damaged file: start over, which needs the exclusive lock
+        if (op != LOCK_EX) {
+            flock(jump_fd, LOCK_UN);
+            return jump_lock(LOCK_EX) && flock(jump_fd, op) == 0;
+        }
+        if (!jump_format(JUMP_MIN_SLOTS, JUMP_MIN_POOL)) {
+            flock(jump_fd, LOCK_UN);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void jump_unlock() {
+    flock(jump_fd, LOCK_UN);
+}
+
+// index slot holding path's entry number, or the free slot where it belongs
+static uint32_t *jump_slot(const char *path, size_t len, uint64_t hash) {
+    uint32_t mask = JUMP_HEADER->slots - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        uint32_t *slot = &JUMP_INDEX[i];
+        if (*slot == 0) {
+            return slot;
+        }
+        JumpEntry *e = &JUMP_ENTRIES[*slot - 1];
+        if (e->hash == hash && e->path_len == len && memcmp(JUMP_POOL + e->path_off, path, len) == 0) {
+            return slot;
+        }
+    }
+}
+
+// appends an entry for path; the caller has made room
+static JumpEntry *jump_insert(uint32_t *slot, const char *path, size_t len, uint64_t hash) {
+    uint32_t n = JUMP_HEADER->count++;
+    JumpEntry *e = &JUMP_ENTRIES[n];
+    e->hash = hash;
+    e->path_off = JUMP_HEADER->pool_used;
+    e->path_len = len;
+    e->rank = 0;
+    e->last_visit = 0;
+    memcpy(JUMP_POOL + e->path_off, path, len + 1);
+    JUMP_HEADER->pool_used += len + 1;
+    JUMP_MASKS[n][0] = JUMP_MASKS[n][1] = 0;
+    jump_mask(path, JUMP_MASKS[n]);
+    *slot = n + 1;
+    return e;
+}
+
+// rewrites the file with `slots` index slots and `pool_cap` bytes of paths,
+// keeping entries ranked at least min_rank; caller holds LOCK_EX
+static bool jump_rebuild(uint32_t slots, uint64_t pool_cap, double min_rank) {
+    uint32_t count = JUMP_HEADER->count;
+    JumpEntry *entries = malloc(count * sizeof(JumpEntry) + 1);
+    char *pool = malloc(JUMP_HEADER->pool_used + 1);
+    if (entries == NULL || pool == NULL) {
+        free(entries);
+        free(pool);
+        return false;
+    }
+    memcpy(entries, JUMP_ENTRIES, count * sizeof(JumpEntry));
+    memcpy(pool, JUMP_POOL, JUMP_HEADER->pool_used);
+
+    bool ok = jump_format(slots, pool_cap);
+    for (uint32_t i = 0; ok && i < count; i++) {
+        JumpEntry *old = &entries[i];
+        if (old->rank < min_rank) {
+            continue;
+        }
+        const char *path = pool + old->path_off;
+        JumpEntry *e = jump_insert(jump_slot(path, old->path_len, old->hash), path, old->path_len, old->hash);
+        e->rank = old->rank;
+        e->last_visit = old->last_visit;
+        JUMP_HEADER->total += e->rank;
+    }
+    free(entries);
+    free(pool);
+    return ok;
+}
+
+// counts a visit to path after a successful cd
+static void jump_visit(const char *path) {
+    if (!jump_lock(LOCK_EX)) {
+        return;
+    }
+    size_t len = strlen(path);
+    uint64_t hash = jump_hash(path, len);
+    uint32_t *slot = jump_slot(path, len, hash);
+    if (*slot == 0) {
+        uint32_t slots = JUMP_HEADER->slots;
+        uint64_t pool_cap = JUMP_HEADER->pool_cap;
+        while ((JUMP_HEADER->count + 1) * 2 > slots) {
+            slots *= 2;
+        }
+        while (JUMP_HEADER->pool_used + len + 1 > pool_cap) {
+            pool_cap *= 2;
+        }
+        if (slots != JUMP_HEADER->slots || pool_cap != JUMP_HEADER->pool_cap) {
+            if (!jump_rebuild(slots, pool_cap, 0)) {
+                jump_unlock();
+                return;
+            }
+            slot = jump_slot(path, len, hash);
+        }
+        jump_insert(slot, path, len, hash);
+    }
+    JumpEntry *e = &JUMP_ENTRIES[*slot - 1];
+    e->rank += 1;
+    e->last_visit = time(NULL);
+    JUMP_HEADER->total += 1;
+
+    // age like z: scale every rank down and forget what falls below 1
+    if (JUMP_HEADER->total > JUMP_MAX_TOTAL) {
+        for (uint32_t i = 0; i < JUMP_HEADER->count; i++) {
+            JUMP_ENTRIES[i].rank *= 0.9;
+        }
+        jump_rebuild(JUMP_HEADER->slots, JUMP_HEADER->pool_cap, 1);
+    }
+    jump_unlock();
+}
+
+static double jump_score(const JumpEntry *e, time_t now) {
+    time_t age = now - e->last_visit;
+    if (age < 3600) {
+        return e->rank * 4;
+    } else if (age < 86400) {
+        return e->rank * 2;
+    } else if (age < 604800) {
+        return e->rank / 2;
+    }
+    return e->rank / 4;
+}
+
+// fragments must appear in order, the last one inside the final component;
+// all-lowercase fragments match either case
+static bool jump_matches(const char *path, char **frags, int nfrags) {
+    const char *p = path;
+    const char *last = strrchr(path, '/');
+    last = last != NULL ? last + 1 : path;
+    for (int i = 0; i < nfrags; i++) {
+        bool icase = true;
+        for (const char *f = frags[i]; *f != '\0'; f++) {
+            if (*f >= 'A' && *f <= 'Z') {
+                icase = false;
+            }
+        }
+        const char *from = i == nfrags - 1 && p < last ? last : p;
+        const char *hit = icase ? strcasestr(from, frags[i]) : strstr(from, frags[i]);
+        if (hit == NULL) {
+            return false;
+        }
+        p = hit + strlen(frags[i]);
+    }
+    return true;
+}
+
+// best match other than cwd, copied into out; false when nothing matches
+static bool jump_best(char **frags, int nfrags, char *out, size_t size) {
+    if (!jump_lock(LOCK_SH)) {
+        return false;
+    }
+    uint64_t want[2] = { 0, 0 };
+    for (int i = 0; i < nfrags; i++) {
+        jump_mask(frags[i], want);
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        cwd[0] = '\0';
+    }
+    time_t now = time(NULL);
+    const JumpEntry *best = NULL;
+    double best_score = 0;
+    uint64_t (*masks)[2] = JUMP_MASKS;
+    for (uint32_t i = 0; i < JUMP_HEADER->count; i++) {
+        if ((masks[i][0] & want[0]) != want[0] || (masks[i][1] & want[1]) != want[1]) {
+            continue;
+        }
+        const JumpEntry *e = &JUMP_ENTRIES[i];
+        double score = jump_score(e, now);
+        if (score <= best_score) {
+            continue;
+        }
+        const char *path = JUMP_POOL + e->path_off;
+        if (strcmp(path, cwd) != 0 && jump_matches(path, frags, nfrags)) {
+            best = e;
+            best_score = score;
+        }
+    }
+    if (best != NULL) {
+        snprintf(out, size, "%s", JUMP_POOL + best->path_off);
+    }
+    jump_unlock();
+    return best != NULL;
+}
+
+// a directory that is gone stops being offered
+static void jump_forget(const char *path) {
+    if (!jump_lock(LOCK_EX)) {
+        return;
+    }
+    size_t len = strlen(path);
+    uint32_t *slot = jump_slot(path, len, jump_hash(path, len));
+    if (*slot != 0) {
+        JumpEntry *e = &JUMP_ENTRIES[*slot - 1];
+        JUMP_HEADER->total -= e->rank;
+        e->rank = 0;
+    }
+    jump_unlock();
+}
+
+static int cmp_jump_score(const void *a, const void *b) {
+    double x = ((const double *)a)[0], y = ((const double *)b)[0];
+    return (x < y) - (x > y);
+}
+
+// j lists the top directories; j frag... and cd -j frag... jump to the best match
+int jump_builtin(char **args) {
+    if (args[1] == NULL) {
+        if (!jump_lock(LOCK_SH)) {
+            return 1;
+        }
+        // (score, entry) pairs sorted by score
+        uint32_t n = 0;
+        double *top = malloc(JUMP_HEADER->count * 2 * sizeof(double) + 1);
+        time_t now = time(NULL);
+        for (uint32_t i = 0; i < JUMP_HEADER->count && top != NULL; i++) {
+            if (JUMP_ENTRIES[i].rank > 0) {
+                top[2 * n] = jump_score(&JUMP_ENTRIES[i], now);
+                top[2 * n + 1] = i;
+                n++;
+            }
+        }
+        if (top != NULL) {
+            qsort(top, n, 2 * sizeof(double), cmp_jump_score);
+        }
+        for (uint32_t k = 0; k < n && k < 20; k++) {
+            fprintf(builtin_stdout(), "%8.1f  %s\n", top[2 * k], JUMP_POOL + JUMP_ENTRIES[(uint32_t)top[2 * k + 1]].path_off);
+        }
+        free(top);
+        jump_unlock();
+        return 0;
+    }
+
+    int nfrags = 0;
+    while (args[nfrags + 1] != NULL) {
+        nfrags++;
+    }
+    char target[PATH_MAX];
+    for (int tries = 0; tries < 16 && jump_best(args + 1, nfrags, target, sizeof(target)); tries++) {
+        if (chdir(target) == 0) {
+            jump_visit(target);
+            return 0;
+        }
+        jump_forget(target);
+    }
+    fprintf(stderr, "wsh: j: no match for %s\n", args[1]);
+    return 1;
+}
+
+void cd(char *path) {
+    if (path == NULL) {
+        fprintf(stderr, "wsh: cd: missing argument\n");
+    } else if (chdir(path) != 0) {
+        perror("wsh: cd");
+    } else {
+        append_cache_flush();
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) != NULL) {
+            jump_visit(cwd);
+        }
+    }
+}
+
+void handle_exit() {
+    exit(EXIT_SUCCESS);
+	}
+
+void handle_export(char *var) {
+    if (var == NULL) {
+        if (!interactive_mode) {
+            fprintf(stderr, "wsh: export: missing argument\n");
+        }
+        last_exit_status = 1;
+        return;
+    }
+
+    char *var_copy = arena_strdup(var);
+
+    char *name = strtok(var_copy, "=");
+    char *value = strtok(NULL, "=");
+    if (value == NULL) {
+        if (!interactive_mode) {
+            fprintf(stderr, "wsh: export: invalid argument\n");
+        }
+        last_exit_status = 1;
+        return;
+    }
+
+    if (strcmp(name, "PATH") == 0) {
+        char *path_copy = arena_strdup(value);
+        char *path = strtok(path_copy, ":");
+        bool all_invalid = true;  
+        while (path != NULL) {
+            struct stat statbuf;
+            if (stat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
+                all_invalid = false;
+                break;  
+            }
+            path = strtok(NULL, ":");
+        }
+        if (all_invalid) {
+            if (!interactive_mode) {
+                fprintf(stderr, "wsh: export: invalid PATH value\n");
+            }
+            path_invalid = true;
+        }
+    }
+
+    if (setenv(name, value, 1) != 0) {
+        if (!interactive_mode) {
+            perror("wsh: export");
+        }
+        last_exit_status = 1;
+        return;
+    }
+
+    last_exit_status = 0;
+}
+
+
+// shell functions: bodies are split into commands and those into words once,
+// at definition time, with the tokenizer every command line goes through
+typedef struct {
+    char *text;                 // the command as written, for profiles
+    ParsedLine line;            // heap copy, NULL stages for a nested definition
+} BodyCommand;
+
+struct ShellFunction {
+    char *name;
+    BodyCommand *body;
+    int count;
+    struct ShellFunction *next;
+};
+
+#define FUNC_BUCKETS 64
+#define MAX_CALL_DEPTH 256
+
+// a shadowed variable restored when the call returns, old_value NULL if it was unset
+typedef struct {
+    char *name;
+    char *old_value;
+} SavedVar;
+
+typedef struct {
+    char **argv;                // argv[0] is the function name
+    int argc;
+    BodyCommand *body;          // the body this call runs, which a redefinition may replace
+    int count;
+    SavedVar *saved;
+    int saved_count;
+    int saved_cap;
+} CallFrame;
+
+static ShellFunction *func_table[FUNC_BUCKETS];
+static CallFrame call_stack[MAX_CALL_DEPTH];
+static int call_depth = 0;
+static bool function_returning = false;
+
+// definition still being read across lines
+static char *pending_name = NULL;
+static char *pending_body = NULL;
+static size_t pending_len = 0;
+static int pending_depth = 0;
+
+static unsigned int func_hash(const char *name) {
+    unsigned int h = 5381;
+    while (*name != '\0') {
+        h = h * 33 + (unsigned char)*name++;
+    }
+    return h % FUNC_BUCKETS;
+}
+
+ShellFunction *find_function(const char *name) {
+    for (ShellFunction *fn = func_table[func_hash(name)]; fn != NULL; fn = fn->next) {
+        if (strcmp(fn->name, name) == 0) {
+            return fn;
+        }
+    }
+    return NULL;
+}
+
+static void free_line(ParsedLine *line) {
+    for (int i = 0; line->stages != NULL && i < line->count; i++) {
+        for (char **w = line->stages[i]; w != NULL && *w != NULL; w++) {
+            free(*w);
+        }
+        free(line->stages[i]);
+    }
+    free(line->stages);
+}
+
+static void free_body(BodyCommand *body, int count) {
+    for (int i = 0; i < count; i++) {
+        free(body[i].text);
+        free_line(&body[i].line);
+    }
+    free(body);
+}
+
+// copies an arena line to the heap; false if out of memory, leaving what was
+// copied to free_line
+static bool keep_line(const ParsedLine *src, ParsedLine *dst) {
+    dst->count = src->count;
+    dst->in_background = src->in_background;
+    dst->stages = calloc(src->count, sizeof(char **));
+    if (dst->stages == NULL) {
+        return false;
+    }
+    for (int i = 0; i < src->count; i++) {
+        int n = 0;
+        while (src->stages[i][n] != NULL) {
+            n++;
+        }
+        dst->stages[i] = calloc(n + 1, sizeof(char *));
+        if (dst->stages[i] == NULL) {
+            return false;
+        }
+        for (int k = 0; k < n; k++) {
+            dst->stages[i][k] = strdup(src->stages[i][k]);
+            if (dst->stages[i][k] == NULL) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// the arena copy a call runs, since builtins may write into their arguments
+static ParsedLine arena_line(const ParsedLine *src) {
+    ParsedLine line = *src;
+    line.stages = arena_alloc(src->count * sizeof(char **));
+    for (int i = 0; i < src->count; i++) {
+        int n = 0;
+        while (src->stages[i][n] != NULL) {
+            n++;
+        }
+        line.stages[i] = arena_alloc((n + 1) * sizeof(char *));
+        for (int k = 0; k < n; k++) {
+            line.stages[i][k] = arena_strdup(src->stages[i][k]);
+        }
+        line.stages[i][n] = NULL;
+    }
+    return line;
+}
+
+// the text after the { of a name() { ... } line, NULL if line is not one
+static const char *definition_start(const char *line, size_t *name_len) {
+    const char *p = line;
+    if (!(*p == '_' || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))) {
+        return NULL;
+    }
+    while (*p == '_' || *p == '-' || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')) {
+        p++;
+    }
+    *name_len = p - line;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (p[0] != '(' || p[1] != ')') {
+        return NULL;
+    }
+    p += 2;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return *p == '{' ? p + 1 : NULL;
+}
+
+// adds one command of a body; a nested definition keeps only its text and is
+// defined when the call reaches it
+static bool body_add(BodyCommand **body, int *count, const char *text) {
+    BodyCommand *grown = realloc(*body, (*count + 1) * sizeof(BodyCommand));
+    if (grown == NULL) {
+        return false;
+    }
+    *body = grown;
+    BodyCommand *cmd = &grown[*count];
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->text = strdup(text);
+    if (cmd->text == NULL) {
+        return false;
+    }
+    (*count)++;  // from here free_body owns it
+    size_t name_len;
+    if (definition_start(text, &name_len) != NULL) {
+        return true;
+    }
+    ArenaMark mark = arena_mark();
+    ParsedLine line;
+    parse_line(text, &line);
+    bool kept = keep_line(&line, &cmd->line);
+    arena_release(mark);
+    return kept;
+}
+
+// splits a body into commands at ; and newlines outside a nested definition's
+// braces; false if out of memory
+static bool body_parse(const char *text, BodyCommand **body, int *count) {
+    *body = NULL;
+    *count = 0;
+    ArenaMark mark = arena_mark();
+    char *copy = arena_strdup(text);
+    char *cmd = arena_alloc(2 * strlen(text) + 2);  // words joined by single spaces
+    size_t len = 0;
+    int depth = 0;
+    bool ok = true;
+    char *saveptr = NULL;
+    for (char *row = strtok_r(copy, "\n", &saveptr); row != NULL && ok; row = strtok_r(NULL, "\n", &saveptr)) {
+        char *cursor = row;
+        bool ends;
+        for (char *w = scan_word(&cursor, &ends); w != NULL && ok; w = scan_word(&cursor, &ends)) {
+            if (w[0] == '#') {
+                break;  // the rest of the row is a comment
+            }
+            size_t n = strlen(w);
+            if (strcmp(w, "{") == 0 || (n >= 3 && strcmp(w + n - 3, "(){") == 0)) {
+                depth++;
+            } else if (strcmp(w, "}") == 0 && depth > 0) {
+                depth--;
+            }
+            if (n > 0) {
+                len += sprintf(cmd + len, "%s%s", len > 0 ? " " : "", w);
+            }
+            if (ends && depth > 0) {
+                len += sprintf(cmd + len, ";");
+            } else if (ends && len > 0) {
+                ok = body_add(body, count, cmd);
+                len = 0;
+            }
+        }
+        if (depth > 0 && len > 0) {
+            len += sprintf(cmd + len, ";");
+        } else if (len > 0 && ok) {
+            ok = body_add(body, count, cmd);
+            len = 0;
+        }
+    }
+    if (len > 0 && ok) {
+        ok = body_add(body, count, cmd);  // an unclosed nested definition
+    }
+    arena_release(mark);
+    if (!ok) {
+        free_body(*body, *count);
+    }
+    return ok;
+}
+
+static bool body_running(BodyCommand *body) {
+    for (int i = 0; i < call_depth; i++) {
+        if (call_stack[i].body == body) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// false, with the function left as it was, if out of memory
+static bool define_function(const char *name, const char *text) {
+    BodyCommand *body;
+    int count;
+    if (!body_parse(text, &body, &count)) {
+        fprintf(stderr, "wsh: %s: %s\n", name, strerror(ENOMEM));
+        return false;
+    }
+
+    ShellFunction *fn = find_function(name);
+    if (fn == NULL) {
+        unsigned int h = func_hash(name);
+        fn = calloc(1, sizeof(ShellFunction));
+        char *copy = strdup(name);
+        if (fn == NULL || copy == NULL) {
+            fprintf(stderr, "wsh: %s: %s\n", name, strerror(ENOMEM));
+            free(fn);
+            free(copy);
+            free_body(body, count);
+            return false;
+        }
+        fn->name = copy;
+        fn->next = func_table[h];
+        func_table[h] = fn;
+        METRIC_ADD(metrics.functions, 1);
+    } else if (!body_running(fn->body)) {
+        // a body redefining its own function keeps running the old copy,
+        // freed when the last call running it returns
+        free_body(fn->body, fn->count);
+    }
+    fn->body = body;
+    fn->count = count;
+    return true;
+}
+
+// appends text to the pending body up to the closing brace, defining the function there
+static void function_scan(const char *text) {
+    const char *p = text;
+    const char *end = NULL;
+    while (*p != '\0' && end == NULL) {
+        while (*p == ' ' || *p == '\t' || *p == ';') {
+            p++;
+        }
+        size_t n = strcspn(p, " \t;");
+        if ((n == 1 && *p == '{') || (n >= 3 && strncmp(p + n - 3, "(){", 3) == 0)) {
+            pending_depth++;
+        } else if (n == 1 && *p == '}' && --pending_depth == 0) {
+            end = p;
+        }
+        p += n;
+    }
+
+    size_t len = end != NULL ? (size_t)(end - text) : strlen(text);
+    char *grown = realloc(pending_body, pending_len + len + 2);
+    if (grown == NULL) {
+        fprintf(stderr, "wsh: %s: %s\n", pending_name, strerror(ENOMEM));
+        last_exit_status = 1;
+        end = text;  // drops the definition
+    } else {
+        pending_body = grown;
+        memcpy(pending_body + pending_len, text, len);
+        pending_len += len;
+        pending_body[pending_len++] = '\n';
+        pending_body[pending_len] = '\0';
+        if (end != NULL) {
+            last_exit_status = define_function(pending_name, pending_body) ? 0 : 1;
+        }
+    }
+
+    if (end != NULL) {
+        free(pending_name);
+        free(pending_body);
+        pending_name = NULL;
+        pending_body = NULL;
+        pending_len = 0;
+    }
+}
+
+bool function_pending() {
+    return pending_name != NULL;
+}
+
+// takes lines of a name() { ... } definition, returns true when the line was consumed
+bool function_collect(const char *line) {
+    if (pending_name != NULL) {
+        function_scan(line);
+        return true;
+    }
+
+    size_t name_len;
+    const char *start = definition_start(line, &name_len);
+    if (start == NULL) {
+        return false;
+    }
+
+    pending_name = strndup(line, name_len);
+    pending_body = strdup("");
+    if (pending_name == NULL || pending_body == NULL) {
+        fprintf(stderr, "wsh: %.*s: %s\n", (int)name_len, line, strerror(ENOMEM));
+        free(pending_name);
+        free(pending_body);
+        pending_name = NULL;
+        pending_body = NULL;
+        last_exit_status = 1;
+        return true;
+    }
+    pending_len = 0;
+    pending_depth = 1;
+    function_scan(start);
+    return true;
+}
+
+// remembers a variable's value before local shadows it inside a call; false
+// if out of memory, when local must leave the variable alone
+static bool save_local(const char *name) {
+    CallFrame *frame = &call_stack[call_depth - 1];
+    for (int i = 0; i < frame->saved_count; i++) {
+        if (strcmp(frame->saved[i].name, name) == 0) {
+            return true;
+        }
+    }
+    if (frame->saved_count == frame->saved_cap) {
+        int cap = frame->saved_cap ? frame->saved_cap * 2 : 8;
+        SavedVar *grown = realloc(frame->saved, cap * sizeof(SavedVar));
+        if (grown == NULL) {
+            return false;
+        }
+        frame->saved = grown;
+        frame->saved_cap = cap;
+    }
+    SavedVar sv = { strdup(name), NULL };
+    for (int i = 0; i < var_count && sv.name != NULL; i++) {
+        if (strcmp(shell_vars[i].name, name) == 0) {
+            sv.old_value = strdup(shell_vars[i].value);
+            if (sv.old_value == NULL) {
+                free(sv.name);
+                return false;
+            }
+            break;
+        }
+    }
+    if (sv.name == NULL) {
+        return false;
+    }
+    frame->saved[frame->saved_count++] = sv;
+    return true;
+}
+
+static void restore_locals(CallFrame *frame) {
+    for (int k = frame->saved_count - 1; k >= 0; k--) {
+        SavedVar *sv = &frame->saved[k];
+        for (int i = 0; i < var_count; i++) {
+            if (strcmp(shell_vars[i].name, sv->name) != 0) {
+                continue;
+            }
+            free(shell_vars[i].value);
+            if (sv->old_value != NULL) {
+                shell_vars[i].value = sv->old_value;
+                shell_vars[i].has_num = false;
+                sv->old_value = NULL;
+            } else {
+                free(shell_vars[i].name);
+                memmove(&shell_vars[i], &shell_vars[i + 1], (var_count - i - 1) * sizeof(ShellVar));
+                var_count--;
+            }
+            break;
+        }
+        free(sv->name);
+        free(sv->old_value);
+    }
+    free(frame->saved);
+}
+
+static void run_body_command(BodyCommand *cmd) {
+    if (cmd->line.stages == NULL) {
+        function_collect(cmd->text);  // a nested definition
+        return;
+    }
+    ArenaMark mark = arena_mark();
+    ParsedLine line = arena_line(&cmd->line);
+    run_parsed(&line);
+    arena_release(mark);
+}
+
+// runs a function body in-process with its own positional parameters
+int call_function(ShellFunction *fn, char **args) {
+    if (call_depth == MAX_CALL_DEPTH) {
+        fprintf(stderr, "wsh: %s: maximum function nesting level exceeded\n", fn->name);
+        return 1;
+    }
+
+    CallFrame *frame = &call_stack[call_depth];
+    memset(frame, 0, sizeof(*frame));
+    while (args[frame->argc] != NULL) {
+        frame->argc++;
+    }
+    // args may point into variables the body is about to change
+    frame->argv = calloc(frame->argc + 1, sizeof(char *));
+    for (int i = 0; i < frame->argc && frame->argv != NULL; i++) {
+        frame->argv[i] = strdup(args[i]);
+        if (frame->argv[i] == NULL) {
+            for (int k = 0; k < i; k++) {
+                free(frame->argv[k]);
+            }
+            free(frame->argv);
+            frame->argv = NULL;
+        }
+    }
+    if (frame->argv == NULL) {
+        fprintf(stderr, "wsh: %s: %s\n", fn->name, strerror(ENOMEM));
+        return 1;
+    }
+
+    frame->body = fn->body;
+    frame->count = fn->count;
+    call_depth++;
+    last_exit_status = 0;
+    for (int i = 0; i < frame->count && !function_returning; i++) {
+        if (profiling()) {
+            char where[64];
+            snprintf(where, sizeof(where), "%s:%d", fn->name, i + 1);
+            profile_begin(where, frame->body[i].text);
+            run_body_command(&frame->body[i]);
+            profile_end();
+        } else {
+            run_body_command(&frame->body[i]);
+        }
+    }
+    function_returning = false;
+    call_depth--;
+    if (frame->body != fn->body && !body_running(frame->body)) {
+        free_body(frame->body, frame->count);
+    }
+
+    restore_locals(frame);
+    for (int i = 0; i < frame->argc; i++) {
+        free(frame->argv[i]);
+    }
+    free(frame->argv);
+    return last_exit_status;
+}
+
+// return [n] leaves the current function
+int return_builtin(char **args) {
+    if (call_depth == 0) {
+        fprintf(stderr, "wsh: return: can only `return' from a function\n");
+        return 1;
+    }
+    function_returning = true;
+    if (args[1] != NULL) {
+        char *endptr;
+        long status = strtol(args[1], &endptr, 10);
+        if (*endptr != '\0') {
+            fprintf(stderr, "wsh: return: %s: numeric argument required\n", args[1]);
+            return 2;
+        }
+        return status & 0xff;
+    }
+    return last_exit_status;
+}
+
+static bool is_positional(const char *name) {
+    if (*name == '\0') {
+        return false;
+    }
+    for (const char *p = name; *p != '\0'; p++) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// value of $name: positional parameters in a call, then environment, then shell vars
+char *get_var_value(const char *name) {
+    if (call_depth > 0) {
+        CallFrame *frame = &call_stack[call_depth - 1];
+        if (strcmp(name, "#") == 0) {
+            static char count[16];
+            snprintf(count, sizeof(count), "%d", frame->argc - 1);
+            return count;
+        }
+        if (is_positional(name)) {
+            long n = strtol(name, NULL, 10);
+            return n < frame->argc ? frame->argv[n] : "";
+        }
+    }
+
+    char *env_value = getenv(name);
+    if (env_value != NULL) {
+        return env_value;
+    }
+    for (int j = 0; j < var_count; j++) {
+        if (strcmp(shell_vars[j].name, name) == 0) {
+            return shell_vars[j].value;
+        }
+    }
+    return NULL;
+}
+
+
+// sets a shell variable, dropping any cached integer
+ShellVar *set_shell_var(const char *name, const char *value) {
+    for (int i = 0; i < var_count; i++) {
+        if (strcmp(shell_vars[i].name, name) == 0) {
+            char *copy = strdup(value);  // value may point at the old one
+            free(shell_vars[i].value);
+            shell_vars[i].value = copy;
+            shell_vars[i].has_num = false;
+            return &shell_vars[i];
+        }
+    }
+    if (var_count == MAX_VARS) {
+        return NULL;
+    }
+    ShellVar *v = &shell_vars[var_count++];
+    v->name = strdup(name);
+    v->value = strdup(value);
+    v->has_num = false;
+    return v;
+}
+
+
+int local(char *var) {
+    if (var == NULL) {
+        fprintf(stderr, "wsh: local: missing argument\n");
+        return 1;
+    }
+
+    char *name = strtok(var, "=");
+    char *value = strtok(NULL, "=");
+    if (value == NULL) {
+        value = "";  
+    }
+
+    // variable replacement
+    if (value[0] == '$') {
+        char *found = get_var_value(value + 1);
+        if (found != NULL) {
+            value = found;
+        }
+    }
+
+    // inside a function local shadows the caller's value until return
+    if (call_depth > 0 && !save_local(name)) {
+        fprintf(stderr, "wsh: local: %s: %s\n", name, strerror(ENOMEM));
+        return 1;
+    }
+
+    if (set_shell_var(name, value) == NULL) {
+        fprintf(stderr, "wsh: local: too many variables\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * $(( )) arithmetic. An expression is compiled once into a postfix program for
+ * a small stack machine and cached by its source text, so a loop body pays
+ * only for evaluation. Variables inside the expression, bare or as $name,
+ * compile to slots rather than being expanded first, which keeps the text and
+ * its cache entry the same from one iteration to the next.
+ */
+
+enum {
+    A_PUSH, A_LOAD, A_STORE, A_PREINC, A_PREDEC, A_POSTINC, A_POSTDEC,
+    A_NEG, A_NOT, A_BNOT, A_BOOL, A_POP,
+    A_MUL, A_DIV, A_MOD, A_ADD, A_SUB, A_SHL, A_SHR, A_POW,
+    A_LT, A_LE, A_GT, A_GE, A_EQ, A_NE, A_BAND, A_BXOR, A_BOR,
+    A_JFALSE, A_JTRUE, A_JZ, A_JMP,
+};
+
+typedef struct {
+    int op;
+    long long arg;          // literal, variable slot or jump target
+} ArithOp;
+
+typedef struct {
+    char *name;
+    int hint;               // last index in shell_vars, checked before use
+} ArithVar;
+
+typedef struct ArithProgram {
+    char *source;
+    ArithOp *code;
+    int len, cap;
+    ArithVar *vars;
+    int var_count;
+    struct ArithProgram *next;
+} ArithProgram;
+
+#define ARITH_BUCKETS 256
+#define ARITH_MAX_CACHED 1024
+#define ARITH_MAX_DEPTH 256
+
+static ArithProgram *arith_cache[ARITH_BUCKETS];
+static int arith_cached;
+
+typedef struct {
+    const char *p;
+    ArithProgram *prog;
+    const char *error;
+    int depth;
+} ArithParser;
+
+static int arith_emit(ArithProgram *prog, int op, long long arg) {
+    if (prog->len == prog->cap) {
+        prog->cap = prog->cap ? prog->cap * 2 : 16;
+        prog->code = realloc(prog->code, prog->cap * sizeof(ArithOp));
+    }
+    prog->code[prog->len] = (ArithOp){ op, arg };
+    return prog->len++;
+}
+
+static int arith_var_slot(ArithProgram *prog, const char *name, size_t len) {
+    for (int i = 0; i < prog->var_count; i++) {
+        if (strlen(prog->vars[i].name) == len && strncmp(prog->vars[i].name, name, len) == 0) {
+            return i;
+        }
+    }
+    prog->vars = realloc(prog->vars, (prog->var_count + 1) * sizeof(ArithVar));
+    prog->vars[prog->var_count] = (ArithVar){ strndup(name, len), -1 };
+    return prog->var_count++;
+}
+
+static void arith_skip(ArithParser *ap) {
+    while (*ap->p == ' ' || *ap->p == '\t' || *ap->p == '\n') {
+        ap->p++;
+    }
+}
+
+static const char *arith_operators[] = {
+    "<<=", ">>=", "**", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "++", "--",
+    "*=", "/=", "%=", "+=", "-=", "&=", "^=", "|=",
+};
+
+// length of the operator at p, longest match first
+static size_t arith_operator(const char *p) {
+    for (size_t i = 0; i < sizeof(arith_operators) / sizeof(arith_operators[0]); i++) {
+        size_t n = strlen(arith_operators[i]);
+        if (strncmp(p, arith_operators[i], n) == 0) {
+            return n;
+        }
+    }
+    return *p != '\0';
+}
+
+// consumes op when it is the whole operator that comes next
+static bool arith_accept(ArithParser *ap, const char *op) {
+    arith_skip(ap);
+    size_t n = strlen(op);
+    if (strncmp(ap->p, op, n) != 0 || arith_operator(ap->p) != n) {
+        return false;
     }
+    ap->p += n;
+    return true;
+}
 
-    // input Redirection 
-    if (redirection_files[0] != NULL) {
-        int fd = open(redirection_files[0], O_RDONLY);
-        if (fd < 0) {
-            if (!interactive_mode) {
-                perror("open");
-            }
-            return;
-        }
-        saved_stdin = dup(STDIN_FILENO);
-        dup2(fd, STDIN_FILENO);
-        close(fd);
+static void arith_fail(ArithParser *ap, const char *msg) {
+    if (ap->error == NULL) {
+        ap->error = msg;
     }
+}
 
-    // osutput redirection
-    if (redirection_files[1] != NULL) {
-        int fd;
-        if (redirection_types[1] == 1) {  // Overwrite
-            fd = open(redirection_files[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        } else {  // Append
-            fd = open(redirection_files[1], O_WRONLY | O_CREAT | O_APPEND, 0644);
+// a variable at p, bare or as $name / ${name}; returns the characters it
+// spans, 0 when there is none
+static size_t arith_name(const char *p, const char **name, size_t *len) {
+    bool dollar = *p == '$';
+    bool brace = dollar && p[1] == '{';
+    const char *s = p + dollar + brace;
+    const char *e = s;
+    if (dollar && (isdigit((unsigned char)*e) || *e == '#')) {
+        e += *e == '#';
+        while (isdigit((unsigned char)*e)) {
+            e++;
         }
-        if (fd < 0) {
-            if (!interactive_mode) {
-                perror("open");
-            }
-            return;
+    } else if (isalpha((unsigned char)*e) || *e == '_') {
+        while (isalnum((unsigned char)*e) || *e == '_') {
+            e++;
         }
-        saved_stdout = dup(STDOUT_FILENO);
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
+    } else {
+        return 0;
+    }
+    if (brace && *e != '}') {
+        return 0;
     }
+    *name = s;
+    *len = e - s;
+    return e + brace - p;
+}
 
-    // stderr redirect
-    if (redirection_files[2] != NULL) {
-        int fd = open(redirection_files[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd < 0) {
-            if (!interactive_mode) {
-                perror("open");
-            }
+// positionals and $# can be read but not assigned
+static bool arith_assignable(const char *name) {
+    return !isdigit((unsigned char)*name) && *name != '#';
+}
+
+static void arith_expr(ArithParser *ap);
+static void arith_assign(ArithParser *ap);
+
+static void arith_unary(ArithParser *ap) {
+    arith_skip(ap);
+    const char *p = ap->p;
+    if ((p[0] == '+' && p[1] == '+') || (p[0] == '-' && p[1] == '-')) {
+        ap->p += 2;
+        arith_skip(ap);
+        const char *name;
+        size_t len, span = arith_name(ap->p, &name, &len);
+        if (span == 0 || !arith_assignable(name)) {
+            arith_fail(ap, "attempted assignment to non-variable");
             return;
         }
-        saved_stderr = dup(STDERR_FILENO);
-        dup2(fd, STDERR_FILENO);
-        close(fd);
+        ap->p += span;
+        arith_emit(ap->prog, p[0] == '+' ? A_PREINC : A_PREDEC, arith_var_slot(ap->prog, name, len));
+        return;
     }
-
-    int builtin_status = process_builtin(args);
-    if (builtin_status != -1) {
-        last_exit_status = builtin_status;
-
-        if (saved_stdout != -1) {
-            dup2(saved_stdout, STDOUT_FILENO);
-            close(saved_stdout);
+    if (*p == '-' || *p == '+' || *p == '!' || *p == '~') {
+        ap->p++;
+        if (++ap->depth > ARITH_MAX_DEPTH) {
+            arith_fail(ap, "expression nested too deeply");
+            return;
         }
-        if (saved_stdin != -1) {
-            dup2(saved_stdin, STDIN_FILENO);
-            close(saved_stdin);
+        arith_unary(ap);
+        ap->depth--;
+        if (*p != '+') {
+            arith_emit(ap->prog, *p == '-' ? A_NEG : *p == '!' ? A_NOT : A_BNOT, 0);
+        }
+        return;
+    }
+    if (*p == '(') {
+        ap->p++;
+        if (++ap->depth > ARITH_MAX_DEPTH) {
+            arith_fail(ap, "expression nested too deeply");
+            return;
         }
-        if (saved_stderr != -1) {
-            dup2(saved_stderr, STDERR_FILENO);
-            close(saved_stderr);
+        arith_expr(ap);
+        ap->depth--;
+        arith_skip(ap);
+        if (*ap->p != ')') {
+            arith_fail(ap, "missing `)'");
+            return;
         }
-
-        return;  
+        ap->p++;
+        return;
     }
-
-    pid_t pid = fork();
-    if (pid < 0) {
-        if (!interactive_mode) {
-            perror("Fork failed");
+    if (isdigit((unsigned char)*p)) {
+        char *end;
+        errno = 0;
+        unsigned long long value = strtoull(p, &end, 0);
+        if (end == p || isalnum((unsigned char)*end) || *end == '_' || errno == ERANGE) {
+            arith_fail(ap, "invalid number");
+            return;
         }
-        last_exit_status = 127;  
+        ap->p = end;
+        arith_emit(ap->prog, A_PUSH, (long long)value);
         return;
     }
+    const char *name;
+    size_t len, span = arith_name(p, &name, &len);
+    if (span == 0) {
+        arith_fail(ap, *p == '\0' ? "operand expected" : "syntax error");
+        return;
+    }
+    ap->p += span;
+    int slot = arith_var_slot(ap->prog, name, len);
+    arith_skip(ap);
+    if (arith_assignable(name) && ((ap->p[0] == '+' && ap->p[1] == '+') || (ap->p[0] == '-' && ap->p[1] == '-'))) {
+        arith_emit(ap->prog, ap->p[0] == '+' ? A_POSTINC : A_POSTDEC, slot);
+        ap->p += 2;
+        return;
+    }
+    arith_emit(ap->prog, A_LOAD, slot);
+}
 
-    if (pid == 0) {
-        if (strchr(args[0], '/') != NULL) {
-            execv(args[0], args);
-        } else {
-            char *path_env = getenv("PATH");
-            if (path_env == NULL) {
-                if (!interactive_mode) {
-                    perror("getenv");
-                }
-                exit(127);
-            }
-
-            char path_copy[MAX_LINE];
-            snprintf(path_copy, sizeof(path_copy), "%s", path_env);
-            char *path = strtok(path_copy, ":");
-            while (path != NULL) {
-                char full_path[MAX_LINE];
-                snprintf(full_path, sizeof(full_path), "%s/%s", path, args[0]);
+static const struct {
+    const char *op;
+    int prec;
+    int code;
+} arith_binary_ops[] = {
+    { "**", 11, A_POW },
+    { "*", 10, A_MUL }, { "/", 10, A_DIV }, { "%", 10, A_MOD },
+    { "+", 9, A_ADD }, { "-", 9, A_SUB },
+    { "<<", 8, A_SHL }, { ">>", 8, A_SHR },
+    { "<=", 7, A_LE }, { ">=", 7, A_GE }, { "<", 7, A_LT }, { ">", 7, A_GT },
+    { "==", 6, A_EQ }, { "!=", 6, A_NE },
+    { "&", 5, A_BAND }, { "^", 4, A_BXOR }, { "|", 3, A_BOR },
+    { "&&", 2, -1 }, { "||", 1, -2 },
+};
 
-                if (access(full_path, X_OK) == 0) {
-                    execv(full_path, args);
+// precedence climbing over the binary operators; ** binds right to left
+static void arith_binary(ArithParser *ap, int min_prec) {
+    arith_unary(ap);
+    while (ap->error == NULL) {
+        int found = -1;
+        for (size_t i = 0; i < sizeof(arith_binary_ops) / sizeof(arith_binary_ops[0]); i++) {
+            if (arith_binary_ops[i].prec >= min_prec) {
+                const char *save = ap->p;
+                if (arith_accept(ap, arith_binary_ops[i].op)) {
+                    found = i;
+                    break;
                 }
-
-                path = strtok(NULL, ":");
+                ap->p = save;
             }
         }
-
-        if (!interactive_mode) {
-            fprintf(stderr, "wsh: command not found: %s\n", args[0]);
+        if (found < 0) {
+            return;
         }
-        exit(127);
-    } else {
-        int status;
-        waitpid(pid, &status, 0);
-
-        if (WIFEXITED(status)) {
-            last_exit_status = WEXITSTATUS(status);
+        int prec = arith_binary_ops[found].prec;
+        int code = arith_binary_ops[found].code;
+        if (code < 0) {
+            // && and || skip the right side once the left decides the result
+            int jump = arith_emit(ap->prog, code == -1 ? A_JFALSE : A_JTRUE, 0);
+            arith_binary(ap, prec + 1);
+            arith_emit(ap->prog, A_BOOL, 0);
+            ap->prog->code[jump].arg = ap->prog->len;
+            continue;
         }
+        arith_binary(ap, code == A_POW ? prec : prec + 1);
+        arith_emit(ap->prog, code, 0);
     }
+}
 
-    if (saved_stdout != -1) {
-        dup2(saved_stdout, STDOUT_FILENO);
-        close(saved_stdout);
-    }
-    if (saved_stdin != -1) {
-        dup2(saved_stdin, STDIN_FILENO);
-        close(saved_stdin);
+static void arith_ternary(ArithParser *ap) {
+    arith_binary(ap, 1);
+    if (ap->error != NULL || !arith_accept(ap, "?")) {
+        return;
     }
-    if (saved_stderr != -1) {
-        dup2(saved_stderr, STDERR_FILENO);
-        close(saved_stderr);
+    int to_else = arith_emit(ap->prog, A_JZ, 0);
+    arith_expr(ap);
+    int to_end = arith_emit(ap->prog, A_JMP, 0);
+    if (!arith_accept(ap, ":")) {
+        arith_fail(ap, "`:' expected for conditional expression");
+        return;
     }
+    ap->prog->code[to_else].arg = ap->prog->len;
+    arith_assign(ap);
+    ap->prog->code[to_end].arg = ap->prog->len;
 }
 
+static const struct {
+    const char *op;
+    int code;
+} arith_assign_ops[] = {
+    { "=", -1 }, { "*=", A_MUL }, { "/=", A_DIV }, { "%=", A_MOD }, { "+=", A_ADD }, { "-=", A_SUB },
+    { "<<=", A_SHL }, { ">>=", A_SHR }, { "&=", A_BAND }, { "^=", A_BXOR }, { "|=", A_BOR },
+};
 
-int process_builtin(char **args) {
-    if (strcmp(args[0], "cd") == 0) {
-        if (args[1] == NULL || args[2] != NULL) {
-            if (!interactive_mode) {
-                fprintf(stderr, "wsh: cd: wrong number of arguments\n");
-            }
-            return 1;
-        } else {
-            cd(args[1]);
+static void arith_assign(ArithParser *ap) {
+    arith_skip(ap);
+    const char *name;
+    size_t len, span = arith_name(ap->p, &name, &len);
+    if (span != 0 && arith_assignable(name)) {
+        const char *after = ap->p + span;
+        while (*after == ' ' || *after == '\t') {
+            after++;
         }
-        return 0;
-    } else if (strcmp(args[0], "pwd") == 0) {
-        char cwd[MAX_LINE];
-        if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            printf("%s\n", cwd);
-        } else {
-            if (!interactive_mode) {
-                perror("wsh: pwd");
+        for (size_t i = 0; i < sizeof(arith_assign_ops) / sizeof(arith_assign_ops[0]); i++) {
+            size_t n = strlen(arith_assign_ops[i].op);
+            if (strncmp(after, arith_assign_ops[i].op, n) != 0 || arith_operator(after) != n) {
+                continue;
+            }
+            int slot = arith_var_slot(ap->prog, name, len);
+            ap->p = after + n;
+            if (arith_assign_ops[i].code >= 0) {
+                arith_emit(ap->prog, A_LOAD, slot);
             }
+            arith_assign(ap);
+            if (arith_assign_ops[i].code >= 0) {
+                arith_emit(ap->prog, arith_assign_ops[i].code, 0);
+            }
+            arith_emit(ap->prog, A_STORE, slot);
+            return;
         }
-        return 0;
-    } else if (strcmp(args[0], "export") == 0) {
-        handle_export(args[1]); 
-        return 0;
-    } else if (strcmp(args[0], "local") == 0) {
-        local(args[1]);
-        return 0;
-    } else if (strcmp(args[0], "vars") == 0) {
-        show_vars();
-        return 0;
-    } else if (strcmp(args[0], "history") == 0) {
-        return process_history_builtin(args);
-    } else if (strcmp(args[0], "ls") == 0) {
-        ls();
-        return 0;
-    } else if (strcmp(args[0], "exit") == 0) {
-        handle_exit();
-        return 0;
     }
-    return -1;
+    arith_ternary(ap);
 }
 
-
-// helper for displaying local vars
-void show_vars() {
-    for (int i = 0; i < var_count; i++) {
-        printf("%s=%s\n", shell_vars[i].name, shell_vars[i].value);
+static void arith_expr(ArithParser *ap) {
+    arith_assign(ap);
+    while (ap->error == NULL && arith_accept(ap, ",")) {
+        arith_emit(ap->prog, A_POP, 0);
+        arith_assign(ap);
     }
 }
 
-
-
-
-int cmp_entries(const void *a, const void *b) {
-    const char **entryA = (const char **)a;
-    const char **entryB = (const char **)b;
-    return strcmp(*entryA, *entryB);
+static void arith_free(ArithProgram *prog) {
+    for (int i = 0; i < prog->var_count; i++) {
+        free(prog->vars[i].name);
+    }
+    free(prog->vars);
+    free(prog->code);
+    free(prog->source);
+    free(prog);
 }
 
-void ls() {
-    DIR *dir;
-    struct dirent *entry;
-    char *entries[MAX_LINE];
-    int count = 0;
-
-    setlocale(LC_COLLATE, "C");
-
-    dir = opendir(".");
-    if (dir == NULL) {
-        perror("wsh: ls");
-        return;
+// compiled program for src, from the cache when it has been seen before
+static ArithProgram *arith_compile(const char *src, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)src[i]) * 16777619u;
     }
-
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_name[0] != '.') {
-            entries[count++] = strdup(entry->d_name); 
+    ArithProgram **bucket = &arith_cache[hash % ARITH_BUCKETS];
+    for (ArithProgram *prog = *bucket; prog != NULL; prog = prog->next) {
+        if (strlen(prog->source) == len && memcmp(prog->source, src, len) == 0) {
+            return prog;
         }
     }
-    closedir(dir);
-    qsort(entries, count, sizeof(char *), cmp_entries);
 
-    for (int i = 0; i < count; i++) {
-        printf("%s\n", entries[i]);
-        free(entries[i]);
+    ArithProgram *prog = calloc(1, sizeof(ArithProgram));
+    prog->source = strndup(src, len);
+    ArithParser ap = { prog->source, prog, NULL, 0 };
+    arith_skip(&ap);
+    if (*ap.p == '\0') {
+        arith_emit(prog, A_PUSH, 0);  // $(( )) is 0
+    } else {
+        arith_expr(&ap);
+        arith_skip(&ap);
+        if (ap.error == NULL && *ap.p != '\0') {
+            arith_fail(&ap, "syntax error");
+        }
     }
-}
-
-
-void cd(char *path) {
-    if (path == NULL) {
-        fprintf(stderr, "wsh: cd: missing argument\n");
-    } else if (chdir(path) != 0) {
-        perror("wsh: cd");
+    if (ap.error != NULL) {
+        fprintf(stderr, "wsh: %s: %s (error token is \"%s\")\n", prog->source, ap.error, ap.p);
+        arith_free(prog);
+        return NULL;
     }
+    // a full cache drops this bucket's chain rather than tracking age
+    if (arith_cached == ARITH_MAX_CACHED) {
+        while (*bucket != NULL) {
+            ArithProgram *old = *bucket;
+            *bucket = old->next;
+            arith_free(old);
+            arith_cached--;
+        }
+    }
+    prog->next = *bucket;
+    *bucket = prog;
+    arith_cached++;
+    return prog;
 }
 
-void handle_exit() {
-    exit(EXIT_SUCCESS);
-	}
-
-void handle_export(char *var) {
-    if (var == NULL) {
-        if (!interactive_mode) {
-            fprintf(stderr, "wsh: export: missing argument\n");
+// shell variable behind a slot, found through its hint when it has not moved
+static ShellVar *arith_shell_var(ArithVar *var) {
+    if (var->hint >= 0 && var->hint < var_count && strcmp(shell_vars[var->hint].name, var->name) == 0) {
+        return &shell_vars[var->hint];
+    }
+    for (int i = 0; i < var_count; i++) {
+        if (strcmp(shell_vars[i].name, var->name) == 0) {
+            var->hint = i;
+            return &shell_vars[i];
         }
-        last_exit_status = 1;
-        return;
     }
+    return NULL;
+}
 
-    char var_copy[MAX_LINE];
-    snprintf(var_copy, sizeof(var_copy), "%s", var);
+static long long arith_parse_value(const char *s) {
+    char *end;
+    long long value = strtoll(s, &end, 0);
+    return end == s ? 0 : value;
+}
 
-    char *name = strtok(var_copy, "=");
-    char *value = strtok(NULL, "=");
-    if (value == NULL) {
-        if (!interactive_mode) {
-            fprintf(stderr, "wsh: export: invalid argument\n");
-        }
-        last_exit_status = 1;
-        return;
+static long long arith_load(ArithVar *var) {
+    if (is_positional(var->name) || strcmp(var->name, "#") == 0 || getenv(var->name) != NULL) {
+        const char *s = get_var_value(var->name);
+        return s != NULL ? arith_parse_value(s) : 0;
     }
-
-    if (strcmp(name, "PATH") == 0) {
-        char path_copy[MAX_LINE];
-        snprintf(path_copy, sizeof(path_copy), "%s", value);
-        char *path = strtok(path_copy, ":");
-        bool all_invalid = true;  
-        while (path != NULL) {
-            struct stat statbuf;
-            if (stat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
-                all_invalid = false;
-                break;  
-            }
-            path = strtok(NULL, ":");
-        }
-        if (all_invalid) {
-            if (!interactive_mode) {
-                fprintf(stderr, "wsh: export: invalid PATH value\n");
-            }
-            path_invalid = true;
-        }
+    ShellVar *v = arith_shell_var(var);
+    if (v == NULL) {
+        return 0;
     }
-
-    if (setenv(name, value, 1) != 0) {
-        if (!interactive_mode) {
-            perror("wsh: export");
-        }
-        last_exit_status = 1;
-        return;
+    if (!v->has_num) {
+        v->num = arith_parse_value(v->value);
+        v->has_num = true;
     }
-
-    last_exit_status = 0;
+    return v->num;
 }
 
-
-void local(char *var) {
-    if (var == NULL) {
-        fprintf(stderr, "wsh: local: missing argument\n");
-        return;
+// assignments update an exported variable in place, otherwise a shell variable
+static bool arith_store(ArithVar *var, long long value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%lld", value);
+    if (getenv(var->name) != NULL) {
+        return setenv(var->name, text, 1) == 0;
     }
-
-    char *name = strtok(var, "=");
-    char *value = strtok(NULL, "=");
-    if (value == NULL) {
-        value = "";  
+    ShellVar *v = arith_shell_var(var);
+    if (v != NULL) {
+        char *copy = strdup(text);
+        free(v->value);
+        v->value = copy;
+    } else if ((v = set_shell_var(var->name, text)) == NULL) {
+        fprintf(stderr, "wsh: %s: too many variables\n", var->name);
+        return false;
     }
+    v->num = value;
+    v->has_num = true;
+    return true;
+}
 
-    // variable replacement
-    if (value[0] == '$') {
-        char *var_name = value + 1; 
-        
-        char *env_value = getenv(var_name);
-        if (env_value != NULL) {
-            value = env_value;  
-        } else {
-            for (int j = 0; j < var_count; j++) {
-                if (strcmp(shell_vars[j].name, var_name) == 0) {
-                    value = shell_vars[j].value; 
+// runs a compiled program; false after a runtime error
+static bool arith_run(ArithProgram *prog, long long *result) {
+    long long *stack = arena_alloc((prog->len + 1) * sizeof(long long));
+    int sp = 0;
+    for (int pc = 0; pc < prog->len; pc++) {
+        ArithOp *op = &prog->code[pc];
+        long long a, b;
+        switch (op->op) {
+        case A_PUSH:
+            stack[sp++] = op->arg;
+            continue;
+        case A_LOAD:
+            stack[sp++] = arith_load(&prog->vars[op->arg]);
+            continue;
+        case A_STORE:
+            if (!arith_store(&prog->vars[op->arg], stack[sp - 1])) {
+                return false;
+            }
+            continue;
+        case A_PREINC:
+        case A_PREDEC:
+        case A_POSTINC:
+        case A_POSTDEC:
+            a = arith_load(&prog->vars[op->arg]);
+            b = (long long)((unsigned long long)a + (op->op == A_PREINC || op->op == A_POSTINC ? 1 : -1));
+            if (!arith_store(&prog->vars[op->arg], b)) {
+                return false;
+            }
+            stack[sp++] = op->op == A_PREINC || op->op == A_PREDEC ? b : a;
+            continue;
+        case A_NEG:
+            stack[sp - 1] = (long long)(0 - (unsigned long long)stack[sp - 1]);
+            continue;
+        case A_NOT:
+            stack[sp - 1] = !stack[sp - 1];
+            continue;
+        case A_BNOT:
+            stack[sp - 1] = ~stack[sp - 1];
+            continue;
+        case A_BOOL:
+            stack[sp - 1] = stack[sp - 1] != 0;
+            continue;
+        case A_POP:
+            sp--;
+            continue;
+        case A_JFALSE:
+            if (stack[sp - 1] == 0) {
+                pc = op->arg - 1;  // leaves the 0 as the result
+            } else {
+                sp--;
+            }
+            continue;
+        case A_JTRUE:
+            if (stack[sp - 1] != 0) {
+                stack[sp - 1] = 1;
+                pc = op->arg - 1;
+            } else {
+                sp--;
+            }
+            continue;
+        case A_JZ:
+            if (stack[--sp] == 0) {
+                pc = op->arg - 1;
+            }
+            continue;
+        case A_JMP:
+            pc = op->arg - 1;
+            continue;
+        }
+
+        b = stack[--sp];
+        a = stack[sp - 1];
+        unsigned long long ua = a, ub = b;
+        long long r = 0;
+        switch (op->op) {
+        case A_MUL: r = (long long)(ua * ub); break;
+        case A_ADD: r = (long long)(ua + ub); break;
+        case A_SUB: r = (long long)(ua - ub); break;
+        case A_DIV:
+        case A_MOD:
+            if (b == 0) {
+                fprintf(stderr, "wsh: %s: division by 0\n", prog->source);
+                return false;
+            }
+            if (b == -1) {
+                r = op->op == A_DIV ? (long long)(0 - ua) : 0;  // LLONG_MIN / -1 wraps
+            } else {
+                r = op->op == A_DIV ? a / b : a % b;
+            }
+            break;
+        case A_SHL: r = (long long)(ua << (b & 63)); break;
+        case A_SHR: r = a >> (b & 63); break;
+        case A_POW:
+            if (b < 0) {
+                fprintf(stderr, "wsh: %s: exponent less than 0\n", prog->source);
+                return false;
+            }
+            for (unsigned long long base = ua, acc = 1;; base *= base) {
+                if (b & 1) {
+                    acc *= base;
+                }
+                b >>= 1;
+                if (b == 0) {
+                    r = (long long)acc;
                     break;
                 }
             }
+            break;
+        case A_LT: r = a < b; break;
+        case A_LE: r = a <= b; break;
+        case A_GT: r = a > b; break;
+        case A_GE: r = a >= b; break;
+        case A_EQ: r = a == b; break;
+        case A_NE: r = a != b; break;
+        case A_BAND: r = a & b; break;
+        case A_BXOR: r = a ^ b; break;
+        case A_BOR: r = a | b; break;
         }
+        stack[sp - 1] = r;
     }
+    *result = stack[sp - 1];
+    return true;
+}
 
-    for (int i = 0; i < var_count; i++) {
-        if (strcmp(shell_vars[i].name, name) == 0) {
-            strcpy(shell_vars[i].value, value);
-            return;
+// end of the $(( )) that starts at s, or NULL when it is not closed
+static const char *arith_end(const char *s) {
+    int depth = 0;
+    for (const char *p = s + 3; *p != '\0'; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            if (depth > 0) {
+                depth--;
+            } else if (p[1] == ')') {
+                return p;
+            } else {
+                return NULL;
+            }
         }
     }
+    return NULL;
+}
 
-    if (var_count < MAX_VARS) 
-    {
-        strcpy(shell_vars[var_count].name, name);
-        strcpy(shell_vars[var_count].value, value);
-        var_count++;
-    } else {
-        fprintf(stderr, "wsh: local: too many variables\n");
+// replaces every $(( )) in word with its value; the word itself when there are
+// none, NULL after an error
+static char *expand_arith(char *word) {
+    char *first = strstr(word, "$((");
+    if (first == NULL) {
+        return word;
+    }
+    size_t cap = strlen(word) + 64, n = 0;
+    char *out = arena_alloc(cap);
+    const char *p = word;
+    for (const char *s = first; s != NULL; s = strstr(p, "$((")) {
+        const char *end = arith_end(s);
+        if (end == NULL) {
+            break;  // left alone, as an unclosed $( is
+        }
+        ArithProgram *prog = arith_compile(s + 3, end - (s + 3));
+        long long value;
+        if (prog == NULL || !arith_run(prog, &value)) {
+            return NULL;
+        }
+        char num[32];
+        int len = snprintf(num, sizeof(num), "%lld", value);
+        size_t need = n + (s - p) + len + strlen(end + 2) + 1;
+        if (need > cap) {
+            out = arena_grow(out, cap, need * 2);
+            cap = need * 2;
+        }
+        memcpy(out + n, p, s - p);
+        n += s - p;
+        memcpy(out + n, num, len);
+        n += len;
+        p = end + 2;
     }
+    strcpy(out + n, p);
+    return out;
 }
 
-
-// substitition helper
-void sub_var(char **args) {
+// substitition helper, $@ expands to every positional parameter; returns the
+// expanded argv from the command arena, or NULL when arithmetic fails
+char **sub_var(char **args) {
+    size_t total = 1;
     for (int i = 0; args[i] != NULL; i++) {
-        if (args[i][0] == '$') {
-            char *var_name = args[i] + 1;  
-            char *env_value = getenv(var_name);
-            if (env_value != NULL) {
-                args[i] = env_value; 
-                continue;
+        bool all = call_depth > 0 && (strcmp(args[i], "$@") == 0 || strcmp(args[i], "$*") == 0);
+        total += all ? (size_t)call_stack[call_depth - 1].argc : 1;
+    }
+    char **out = arena_alloc(total * sizeof(char *));
+    int n = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (call_depth > 0 && (strcmp(args[i], "$@") == 0 || strcmp(args[i], "$*") == 0)) {
+            CallFrame *frame = &call_stack[call_depth - 1];
+            for (int k = 1; k < frame->argc; k++) {
+                out[n++] = frame->argv[k];
             }
-
-            for (int j = 0; j < var_count; j++) {
-                if (strcmp(shell_vars[j].name, var_name) == 0) {
-                    args[i] = shell_vars[j].value; 
-                    break;
+            continue;
+        }
+        char *value = expand_arith(args[i]);
+        if (value == NULL) {
+            return NULL;
+        }
+        if (value == args[i] && args[i][0] == '$') {
+            char *found = get_var_value(args[i] + 1);
+            if (found != NULL) {
+                // unset positionals vanish rather than leaving an empty word
+                if (found[0] == '\0' && is_positional(args[i] + 1)) {
+                    continue;
                 }
+                value = arena_strdup(found);  // a later $(( )) may reassign it
             }
         }
+        out[n++] = value;
     }
+    out[n] = NULL;
+    return out;
 }
 
 
@@ -548,36 +7223,29 @@ void history_add(char *cmd) {
         return; 
     }
 
-    char trimmed_cmd[MAX_LINE];
-    strncpy(trimmed_cmd, cmd, sizeof(trimmed_cmd) - 1);
-    trimmed_cmd[sizeof(trimmed_cmd) - 1] = '\0';
-
-    char *start = trimmed_cmd;
-    while (*start == ' ' || *start == '\t') {
-        start++;
+    while (*cmd == ' ' || *cmd == '\t') {
+        cmd++;
     }
-    char *end = start + strlen(start) - 1;
-    while (end > start && (*end == ' ' || *end == '\t')) {
-        *end = '\0';
-        end--;
+    size_t len = strlen(cmd);
+    while (len > 0 && (cmd[len - 1] == ' ' || cmd[len - 1] == '\t')) {
+        len--;
     }
-    if (*start == '\0') {
+    if (len == 0) {
         return;
     }
-    if (is_builtin_command(start)) {
-        return;  
-    }
-    if (hist_count > 0 && strcmp(start, history[hist_count - 1]) == 0) {
+    char *start = strndup(cmd, len);
+    if (is_builtin_command(start) || (hist_count > 0 && strcmp(start, history[hist_count - 1]) == 0)) {
+        free(start);
         return;
     }
     if (hist_count < history_size) {
-        history[hist_count++] = strdup(start);
+        history[hist_count++] = start;
     } else {
         free(history[0]);
         for (int i = 1; i < history_size; i++) {
             history[i - 1] = history[i];
         }
-        history[history_size - 1] = strdup(start);
+        history[history_size - 1] = start;
     }
 }
 
@@ -608,28 +7276,22 @@ char *trimmer(char *str) {
 
 void show_hist() {
     for (int i = hist_count - 1; i >= 0; i--) {
-        printf("%d) %s\n", hist_count - i, history[i]);
+        fprintf(builtin_stdout(), "%d) %s\n", hist_count - i, history[i]);
     }
 }
 
 // helper tp  check if command is builtin
 bool is_builtin_command(char *cmd) {
-    char temp_cmd[MAX_LINE];
-    strncpy(temp_cmd, cmd, sizeof(temp_cmd) - 1);
-    temp_cmd[sizeof(temp_cmd) - 1] = '\0';
-    char *first_token = strtok(temp_cmd, " ");
-
-    if (first_token == NULL) {
+    cmd += strspn(cmd, " ");
+    size_t len = strcspn(cmd, " ");
+    if (len == 0) {
         return false;
     }
 
-    if (strcmp(first_token, "cd") == 0 ||  
-        strcmp(first_token, "export") == 0 || strcmp(first_token, "local") == 0 || 
-        strcmp(first_token, "vars") == 0 || strcmp(first_token, "ls") == 0 || 
-        strcmp(first_token, "exit") == 0 || strcmp(first_token, "history") == 0) {
-        return true;
-    }
-    return false;
+    char *first_token = strndup(cmd, len);
+    const Builtin *b = find_builtin(first_token);
+    free(first_token);
+    return b != NULL && !b->history;
 }
 
 
@@ -641,7 +7303,7 @@ void process_history_command(int index) {
     }
 
     char *command = history[index];
-    printf("%s\n", command);  
+    fprintf(builtin_stdout(), "%s\n", command);  
     process_cmd(command, false); 
 }
 
@@ -705,21 +7367,67 @@ int main(int argc, char *argv[]) {
         perror("Failed to set PATH");
         return 1;  
     }
+    metrics_init();
+    builtins_init();
 
-    if (argc == 1) {
+    // leading options, then an optional batch file
+    int argi = 1;
+    const char *metrics_file = NULL;
+    bool exec_last = false;
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--profile") == 0 && argi + 1 < argc) {
+            profile_start(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--record") == 0 && argi + 1 < argc) {
+            record_start(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--metrics-interval") == 0 && argi + 1 < argc &&
+                   atof(argv[argi + 1]) > 0) {
+            metrics_interval = atof(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--metrics-file") == 0 && argi + 1 < argc) {
+            metrics_file = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--exec-last") == 0) {
+            exec_last = true;
+            argi++;
+        } else if (strcmp(argv[argi], "--fork-builtins") == 0) {
+            fork_builtins = true;
+            argi++;
+        } else {
+            fprintf(stderr, "Usage: %s [--profile file] [--metrics-file file] [--metrics-interval secs] [--record file] [--exec-last] [--fork-builtins] [-c command | batch_file | -]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (metrics_file != NULL) {
+        metrics_start(metrics_file, metrics_interval);
+    }
+
+    if (argi == argc) {
         interactive_mode = 1;  
+        setlocale(LC_CTYPE, "");
         shell_loop();  
-    } else if (argc == 2) {
+    } else if (argi + 1 == argc || (argi + 2 == argc && strcmp(argv[argi], "-c") == 0)) {
         interactive_mode = 0;  
-        FILE *file = fopen(argv[1], "r");
+        // -c runs its argument as a script of its own, - reads the script from stdin
+        bool inline_script = argi + 2 == argc;
+        bool from_stdin = !inline_script && strcmp(argv[argi], "-") == 0;
+        FILE *file = inline_script ? fmemopen(argv[argi + 1], strlen(argv[argi + 1]), "r") :
+                     from_stdin ? stdin : fopen(argv[argi], "r");
         if (!file) {
             perror("Error opening batch file");
             exit(EXIT_FAILURE);
         }
+        const char *source = inline_script ? "-c" : from_stdin ? "stdin" :
+                             strrchr(argv[argi], '/') ? strrchr(argv[argi], '/') + 1 : argv[argi];
 
-        char line[MAX_LINE];
-        while (fgets(line, sizeof(line), file)) {
+        char *line = NULL;
+        size_t size = 0;
+        int lineno = 0;
+        while (getline(&line, &size, file) >= 0) {
             line[strcspn(line, "\n")] = '\0';
+            lineno++;
+            background_reap();
 
             char *trimmed_line = line;
             while (*trimmed_line == ' ' || *trimmed_line == '\t') {
@@ -729,12 +7437,27 @@ int main(int argc, char *argv[]) {
             if (trimmed_line[0] == '#' || trimmed_line[0] == '\0') {
                 continue; 
             }
+            if (function_collect(trimmed_line)) {
+                record_definition(trimmed_line);
+                continue;
+            }
 
-            process_cmd(trimmed_line, true);
+            // nothing after this line: its command can replace the shell, unless
+            // profiling, recording or metrics still need to see it finish
+            if (exec_last && record_file == NULL && metrics_path == NULL && !profiling()) {
+                int next = fgetc(file);
+                tail_exec_armed = next == EOF;
+                ungetc(next, file);
+            }
+            run_line(trimmed_line, source, lineno);
+            tail_exec_armed = false;
+        }
+        free(line);
+        if (!from_stdin) {
+            fclose(file);
         }
-        fclose(file);
     } else {
-        fprintf(stderr, "Usage: %s [batch_file]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--profile file] [--metrics-file file] [--metrics-interval secs] [--record file] [--exec-last] [--fork-builtins] [-c command | batch_file | -]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
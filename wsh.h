@@ -1,35 +1,158 @@
 #ifndef WSH_H
 #define WSH_H
 #define MAX_VARS 100
-#define MAX_LINE 1024   // Maximum command line length
-#define MAX_ARGS 64     // Maximum number of arguments per command
 #define MAX_VARS 100
 #include <stdbool.h>
+#include <sys/types.h>
+#include <sched.h>
 
 typedef struct {
-    char name[MAX_LINE];
-    char value[MAX_LINE];
+    char *name;
+    char *value;
+    long long num;          // value as an integer, cached by $(( ))
+    bool has_num;
 } ShellVar;
 
+#define MAX_BUILTINS 64   // Core and loaded builtins together
+#define MAX_REDIRS 16     // Maximum number of redirections per command
+
+enum { REDIR_OPEN, REDIR_DUP, REDIR_CLOSE };
+
+// one redirection: open target onto fd, dup dup_fd onto fd, or close fd
+typedef struct {
+    int fd;
+    int kind;
+    int flags;              // open flags for REDIR_OPEN
+    int dup_fd;
+    bool both;              // &> also points stderr at the file
+    char compress;          // 'g' gzip or 'z' zstd through a helper, 0 for none
+    char *target;
+} Redirect;
+
+typedef struct {
+    Redirect items[MAX_REDIRS];
+    int count;
+    struct {
+        int fd;
+        int copy;           // -1 if fd was closed before
+    } saved[MAX_REDIRS * 2];
+    int saved_count;
+} RedirList;
+
+#define MAX_PROCSUBS 8    // Maximum number of <(cmd) / >(cmd) per command
+
+typedef struct SupervisedChild SupervisedChild;
+
+// pipes and children behind the /dev/fd paths of one command
+typedef struct {
+    int fds[MAX_PROCSUBS];
+    SupervisedChild *children[MAX_PROCSUBS];
+    char paths[MAX_PROCSUBS][24];
+    int count;
+} ProcSubs;
+
+typedef struct ShellFunction ShellFunction;
+
+// builtin dispatch entry; history says whether the command is recorded,
+// threaded whether a foreground pipeline may run it on a thread instead of a fork
+typedef struct {
+    const char *name;
+    int (*fn)(char **args);
+    bool history;
+    bool threaded;
+} Builtin;
+
+// filters for the recursive tree walk
+typedef struct {
+    const char *name_pattern;
+    char type;              // 'f', 'd', 'l' or 0 for any
+    int size_cmp;           // -1 less, 0 equal, 1 greater, 2 unset
+    off_t size;
+    off_t size_unit;
+    int mtime_cmp;
+    long mtime_days;
+    int max_depth;          // -1 for unlimited
+    bool need_stat;
+    bool skip_hidden;
+    bool bare_root;         // print "a/b" rather than "./a/b" for root "."
+    bool sorted;
+} WalkFilter;
+
+// cpu, priority and io scheduling applied to a launched command
+typedef struct {
+    bool has_cpus;
+    cpu_set_t cpus;
+    bool has_nice;
+    int nice;
+    int policy;             // SCHED_* or -1 to inherit
+    int priority;           // realtime priority for fifo/rr
+    int io_class;           // ioprio class or -1 to inherit
+    int io_level;
+    double timeout;         // seconds until timeout_signal, 0 for none
+    int timeout_signal;
+    double kill_after;      // seconds from timeout_signal to SIGKILL, 0 for none
+    int batch;              // leading args kept when splitting past ARG_MAX, -1 for off
+} LaunchAttrs;
+
+#define LAUNCH_ATTRS_INIT { .policy = -1, .io_class = -1, .batch = -1 }
+
+#define WALK_FILTER_INIT { .size_cmp = 2, .size_unit = 1, .mtime_cmp = 2, .max_depth = -1 }
 
 
 void run_shell();                  // Main shell loop
 void process_cmd(char *cmd, bool add_to_history);    // Execute a single command
+void background_reap();  // Collects finished background jobs without blocking
 int process_builtin(char **args);
-void handle_redirection(char *cmd); // Handle redirection (>, <, etc.)
+int builtin_call(const Builtin *b, char **args);
+const Builtin *find_builtin(const char *name);
+void builtins_init();      // Core builtin slots, before the first lookup
+void apply_redirects(RedirList *list);        // Child side, no restore
+int apply_redirects_saved(RedirList *list);   // Builtin side, saves fds first
+void restore_redirects(RedirList *list);
 void history_add(char *cmd);
 void show_history();                // Display the history
 void cd(char *path);  // Built-in command to change directory
+int jump_builtin(char **args);     // Built-in frecency jump, also cd -j
 void handle_export(char *var) ;
-void local(char *var);       // Built-in command to set shell variables
+int local(char *var);        // Built-in command to set shell variables
 void handle_exit();                 
 void ls();
+int walk_paths(char **roots, int nroots, WalkFilter *filter, int threads);
+int walk_builtin(char **args);     // Built-in recursive tree walk
+void launch_external(char **args, LaunchAttrs *attrs, RedirList *redirs);  // fork + exec, redirecting in the child
+int run_builtin(char **args);      // Built-in run with cpu/nice/sched/ionice options
+int exec_command(char **args, RedirList *redirs);  // Replace the shell, returns only on failure
+int sched_builtin(char **args);    // Built-in to inspect or set launch defaults
+int timeout_builtin(char **args);  // Built-in timeout on the child supervisor
+SupervisedChild *supervise_add(pid_t pid, long long timeout_ns, int sig, long long kill_after_ns);
+int supervise_wait(SupervisedChild *c, bool *timed_out);  // Event loop until c exits
+bool supervise_done(SupervisedChild *c);  // Reaps c if it has exited, never blocks
+void supervisor_reset_after_fork();
+void profile_start(const char *path);   // --profile: folded stacks + summary at exit
+bool profiling();
+void profile_begin(const char *where, const char *cmd);
+void profile_end();
+void metrics_init();    // Shares the exec counters with forked children
+void metrics_name_builtin(int index, const char *name);
+void metrics_start(const char *path, double interval);  // --metrics-file: periodic Prometheus text
+int stats_builtin(char **args);    // Built-in counters and spawn latency
+void record_start(const char *path);    // --record: one JSON line per command
+void record_definition(const char *line);
+void run_line(char *line, const char *source, int lineno);
 char *get_var_value(const char *name);
-void sub_var(char **args);
+ShellVar *set_shell_var(const char *name, const char *value);  // NULL when the table is full
+char **sub_var(char **args);      // Expanded argv, allocated per command
+ShellFunction *find_function(const char *name);
+int call_function(ShellFunction *fn, char **args);  // Run a shell function in-process
+int return_builtin(char **args);
+bool function_collect(const char *line);  // Consume lines of a name() { ... } definition
+bool function_pending();
 void show_vars();
 
 extern int history_count;           
 extern ShellVar shell_vars[MAX_VARS];
 extern int var_count;
+extern Builtin builtin_table[MAX_BUILTINS];     // NULL-terminated
+extern LaunchAttrs launch_defaults;
 
 #endif
@@ -0,0 +1,30 @@
+#ifndef WSH_PLUGIN_H
+#define WSH_PLUGIN_H
+
+// ABI for builtins loaded with `enable -f plugin.so name...`.
+//
+// For each name the plugin exports a WshBuiltin called <name>_wsh_builtin.
+// The shell calls run in its own process, after the command's redirections
+// are applied, so a plugin must not exit, and it should write to ctx->out
+// rather than through stdio. Everything here only ever grows at the end.
+
+#define WSH_PLUGIN_ABI 1
+
+typedef struct WshContext WshContext;
+
+// the shell, as a plugin sees it for one call
+struct WshContext {
+    int abi;                    // WSH_PLUGIN_ABI of the running shell
+    int in, out, err;           // standard streams for this call
+    int last_status;            // status of the previous command
+    const char *(*get_var)(const char *name);   // positional, environment or shell variable, NULL if unset
+    int (*set_var)(const char *name, const char *value);  // shell variable, -1 for a bad name or a full table
+};
+
+typedef struct {
+    int abi;                    // WSH_PLUGIN_ABI the plugin was built against
+    const char *name;
+    int (*run)(int argc, char **argv, WshContext *ctx);  // returns the exit status
+} WshBuiltin;
+
+#endif